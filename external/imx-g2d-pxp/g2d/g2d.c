@@ -21,6 +21,10 @@
 #include <unistd.h>
 #include <linux/pxp_device.h>
 #include "g2d.h"
+#include "g2dExt.h"
+#include "g2d_format_traits.h"
+#include "g2d_clip.h"
+#include "g2d_color.h"
 
 #ifdef BUILD_FOR_ANDROID
 #include <cutils/log.h>
@@ -52,105 +56,61 @@ struct g2dContext {
 	unsigned int current_type;
 	unsigned char dither;
 	unsigned char blend_dim;
+	/* blits only write inside the clip rect, empty rect disables it */
+	int clip_left;
+	int clip_top;
+	int clip_right;
+	int clip_bottom;
 };
 
 static unsigned int g2d_pxp_fmt_map(unsigned int format)
 {
 	switch(format) {
-	case G2D_RGB565:
-#ifdef BUILD_FOR_ANDROID
-		return PXP_PIX_FMT_RGB565;
-#else
-		return PXP_PIX_FMT_BGR565;
-#endif
-	case G2D_BGR565:
-		return PXP_PIX_FMT_RGB565;
-	case G2D_BGRX8888:
-		return PXP_PIX_FMT_XRGB32;
-	case G2D_BGRA8888:
-		return PXP_PIX_FMT_ARGB32;
-	case G2D_XRGB8888:
-		return PXP_PIX_FMT_BGRX32;
-	case G2D_ARGB8888:
-		return PXP_PIX_FMT_BGRA32;
-	case G2D_RGBA8888:
-#ifdef BUILD_FOR_ANDROID
-		return PXP_PIX_FMT_ARGB32;
-#else
-		return PXP_PIX_FMT_ABGR32;
-#endif
-	case G2D_RGBX8888:
-#ifdef BUILD_FOR_ANDROID
-		return PXP_PIX_FMT_XRGB32;
-#else
-		return PXP_PIX_FMT_XBGR32;
-#endif
-	/* yuv format */
-	case G2D_UYVY:
-		return PXP_PIX_FMT_UYVY;
-	case G2D_VYUY:
-		return PXP_PIX_FMT_VYUY;
-	case G2D_YUYV:
-		return PXP_PIX_FMT_YUYV;
-	case G2D_YVYU:
-		return PXP_PIX_FMT_YVYU;
-	case G2D_I420:
-		return PXP_PIX_FMT_YUV420P;
-	case G2D_YV12:
-		return PXP_PIX_FMT_YVU420P;
-	case G2D_NV12:
-		return PXP_PIX_FMT_NV12;
-	case G2D_NV21:
-		return PXP_PIX_FMT_NV21;
-	case G2D_NV16:
-		return PXP_PIX_FMT_NV16;
-	case G2D_NV61:
-		return PXP_PIX_FMT_NV61;
+#define G2D_FORMAT(fmt, pxp, bpp, bits, layout, yuv, hal) \
+	case fmt:				     \
+		if (pxp)			     \
+			return pxp;		     \
+		break;
+	G2D_FORMAT_TABLE
+#undef G2D_FORMAT
 	default:
-		g2d_printf("%s: unsupported format 0x%x\n",
-			   __func__, format);
 		break;
 	}
 
+	g2d_printf("%s: unsupported format 0x%x\n", __func__, format);
 	return 0;
 }
 
 static int g2d_get_bpp(unsigned int format)
 {
-	switch(format) {
-	case G2D_RGB565:
-		return 16;
-	case G2D_BGRX8888:
-	case G2D_BGRA8888:
-	case G2D_RGBA8888:
-	case G2D_RGBX8888:
-	case G2D_ARGB8888:
-	case G2D_XRGB8888:
-	case G2D_ABGR8888:
-	case G2D_XBGR8888:
-		return 32;
-	case G2D_UYVY:
-	case G2D_YUYV:
-	case G2D_VYUY:
-	case G2D_YVYU:
-		return 16;
-	/* for the multi-plane format,
-	 * only return the bits number
-	 * for Y plane
+	/* for the multi-plane format, only
+	 * the bits number for Y plane is returned.
 	 */
-	case G2D_NV12:
-	case G2D_NV21:
-	case G2D_NV16:
-	case G2D_NV61:
-	case G2D_YV12:
-	case G2D_I420:
-		return 8;
+	switch(format) {
+#define G2D_FORMAT(fmt, pxp, bpp, bits, layout, yuv, hal) \
+	case fmt:				     \
+		return bpp;
+	G2D_FORMAT_TABLE
+#undef G2D_FORMAT
 	default:
 		g2d_printf("%s: unsupported format for getting bpp\n", __func__);
 	}
 	return 0;
 }
 
+static int g2d_is_yuv(unsigned int format)
+{
+	switch(format) {
+#define G2D_FORMAT(fmt, pxp, bpp, bits, layout, yuv, hal) \
+	case fmt:				     \
+		return yuv;
+	G2D_FORMAT_TABLE
+#undef G2D_FORMAT
+	default:
+		return 0;
+	}
+}
+
 int g2d_open(void **handle)
 {
 	int ret;
@@ -598,15 +558,28 @@ int g2d_clear(void *handle, struct g2d_surface *area)
 		return -1;
 	}
 
-	out_param->width  = area->stride;
-	out_param->height = area->height;
+	if (area->right - area->left <= 0 || area->bottom - area->top <= 0 ||
+	    area->right > area->width || area->bottom > area->height) {
+		g2d_printf("%s: invalid clear rect, left %d, top %d, right %d, bottom %d!\n",
+			   __func__, area->left, area->top, area->right, area->bottom);
+		return -1;
+	}
+
+	/* only the area rect is filled, store starts at its top left */
+	out_param->left   = area->left;
+	out_param->top    = area->top;
+	out_param->width  = area->right - area->left;
+	out_param->height = area->bottom - area->top;
 	out_param->stride = area->stride * g2d_get_bpp(area->format) >> 3;
 	out_param->paddr  = area->planes[0];
 
 	pxp_conf.proc_data.fill_en = 1;
-	pxp_conf.proc_data.bgcolor = area->clrcolor;
-	pxp_conf.proc_data.drect.width = area->width;
-	pxp_conf.proc_data.drect.height = area->height;
+	/* the store engine writes fill data as is, in the output format */
+	pxp_conf.proc_data.bgcolor = g2d_pack_color(area->clrcolor, area->format);
+	pxp_conf.proc_data.drect.left = area->left;
+	pxp_conf.proc_data.drect.top = area->top;
+	pxp_conf.proc_data.drect.width = area->right - area->left;
+	pxp_conf.proc_data.drect.height = area->bottom - area->top;
 
 	pxp_conf.handle = context->handle;
 	g2d_config_chan(&pxp_conf);
@@ -614,13 +587,58 @@ int g2d_clear(void *handle, struct g2d_surface *area)
 	return 0;
 }
 
-int g2d_blit(void *handle, struct g2d_surface *src, struct g2d_surface *dst)
+/*
+ * trim dst rect to the clip rect and src rect to the part landing in it,
+ * bg rect follows dst. Rotation and flips are mapped back to the source
+ * axes, flips apply to the source before rotation. Source edges are
+ * rounded outwards when scaling. Returns 1 if nothing is left to blit.
+ */
+static int g2d_clip_rects(struct g2dContext *context, struct g2d_surface *src,
+			  struct g2d_surface *bg, struct g2d_surface *dst)
+{
+	int x0, x1, y0, y1;
+
+	x0 = context->clip_left > dst->left ? context->clip_left : dst->left;
+	y0 = context->clip_top > dst->top ? context->clip_top : dst->top;
+	x1 = context->clip_right < dst->right ? context->clip_right : dst->right;
+	y1 = context->clip_bottom < dst->bottom ? context->clip_bottom : dst->bottom;
+	if (x0 >= x1 || y0 >= y1)
+		return 1;
+
+	x0 -= dst->left;
+	x1 -= dst->left;
+	y0 -= dst->top;
+	y1 -= dst->top;
+	g2d_clip_source(src, dst, x0, y0, x1, y1);
+
+	if (bg) {
+		bg->left  += x0;
+		bg->top   += y0;
+		bg->right  = bg->left + x1 - x0;
+		bg->bottom = bg->top + y1 - y0;
+	}
+
+	dst->right  = dst->left + x1;
+	dst->bottom = dst->top + y1;
+	dst->left  += x0;
+	dst->top   += y0;
+
+	return 0;
+}
+
+/*
+ * blend src over bg into dst. bg is fetched through the second input with
+ * the same size as dst rect, g2d_blit passes dst itself as bg.
+ */
+static int g2d_blit_internal(void *handle, struct g2d_surface *src,
+			     struct g2d_surface *bg, struct g2d_surface *dst)
 {
 	struct pxp_config_data pxp_conf;
 	struct pxp_proc_data *proc_data;
 	struct pxp_alpha *s0_alpha, *s1_alpha;
 	struct pxp_layer_param *src_param, *out_param, *third_param = NULL;
 	unsigned int srcWidth,srcHeight,dstWidth,dstHeight;
+	struct g2d_surface clip_src, clip_bg, clip_dst;
 	struct g2dContext *context = (struct g2dContext *)handle;
 
 	if (context == NULL) {
@@ -671,7 +689,25 @@ int g2d_blit(void *handle, struct g2d_surface *src, struct g2d_surface *dst)
 		return -1;
 	}
 
-	if (src->format >= G2D_NV12 && src->global_alpha == 0xff) {
+	if (context->clip_left < context->clip_right &&
+	    context->clip_top < context->clip_bottom) {
+		clip_src = *src;
+		clip_dst = *dst;
+		if (bg == dst) {
+			if (g2d_clip_rects(context, &clip_src, NULL, &clip_dst))
+				return 0;
+			bg = &clip_dst;
+		} else {
+			clip_bg = *bg;
+			if (g2d_clip_rects(context, &clip_src, &clip_bg, &clip_dst))
+				return 0;
+			bg = &clip_bg;
+		}
+		src = &clip_src;
+		dst = &clip_dst;
+	}
+
+	if (bg == dst && g2d_is_yuv(src->format) && src->global_alpha == 0xff) {
 		context->blending = 0;
 	}
 	memset(&pxp_conf, 0, sizeof(struct pxp_config_data));
@@ -739,13 +775,13 @@ int g2d_blit(void *handle, struct g2d_surface *src, struct g2d_surface *dst)
 
 		third_param = &(pxp_conf.ol_param[0]);
 //		g2d_fill_param(third_param, dst);
-		third_param->left   = dst->left;
-		third_param->top    = dst->top;
+		third_param->left   = bg->left;
+		third_param->top    = bg->top;
 		third_param->width  = dst->right - dst->left;
 		third_param->height = dst->bottom - dst->top;
-		third_param->stride = dst->stride * g2d_get_bpp(dst->format) >> 3;
-		third_param->paddr  = dst->planes[0];
-		third_param->pixel_fmt = g2d_pxp_fmt_map(dst->format);
+		third_param->stride = bg->stride * g2d_get_bpp(bg->format) >> 3;
+		third_param->paddr  = bg->planes[0];
+		third_param->pixel_fmt = g2d_pxp_fmt_map(bg->format);
 
 		proc_data->combine_enable = 1;
 		proc_data->alpha_mode = ALPHA_MODE_PORTER_DUFF;
@@ -834,6 +870,96 @@ int g2d_blit(void *handle, struct g2d_surface *src, struct g2d_surface *dst)
 	return 0;
 }
 
+/*
+ * restrict following blits to the rect in dst coordinates, an empty rect
+ * disables clipping. Clears are not clipped.
+ */
+int g2d_set_clipping(void *handle, int left, int top, int right, int bottom)
+{
+	struct g2dContext *context = (struct g2dContext *)handle;
+
+	if (context == NULL) {
+		g2d_printf("%s: invalid handle\n", __func__);
+		return -1;
+	}
+
+	context->clip_left = left;
+	context->clip_top = top;
+	context->clip_right = right;
+	context->clip_bottom = bottom;
+
+	return 0;
+}
+
+int g2d_blit(void *handle, struct g2d_surface *src, struct g2d_surface *dst)
+{
+	return g2d_blit_internal(handle, src, dst, dst);
+}
+
+/*
+ * pxp fetch and store engines only walk linear memory, their block mode
+ * is the 8x8 rotation unit and can't follow gpu tile layouts. Tiled
+ * surfaces are refused before anything is queued to the channel.
+ */
+int g2d_blitEx(void *handle, struct g2d_surfaceEx *srcEx,
+	       struct g2d_surfaceEx *dstEx)
+{
+	if (!srcEx || !dstEx) {
+		g2d_printf("%s: Invalid src and dst parameters!\n", __func__);
+		return -1;
+	}
+
+	if ((srcEx->tiling & ~G2D_LINEAR) || (dstEx->tiling & ~G2D_LINEAR)) {
+		g2d_printf("%s: unsupported tiling src 0x%x dst 0x%x!\n",
+			   __func__, srcEx->tiling, dstEx->tiling);
+		return -1;
+	}
+
+	return g2d_blit(handle, &srcEx->base, &dstEx->base);
+}
+
+/*
+ * blend src over bg and write the result to dst in one pass, so dst is
+ * not read back. bg is not scaled or rotated, its rect must have the same
+ * size as dst rect.
+ */
+int g2d_blit_composite(void *handle, struct g2d_surface *src,
+		       struct g2d_surface *bg, struct g2d_surface *dst)
+{
+	struct g2dContext *context = (struct g2dContext *)handle;
+
+	if (context == NULL) {
+		g2d_printf("%s: Invalid handle!\n", __func__);
+		return -1;
+	}
+
+	if (!src || !bg || !dst) {
+		g2d_printf("%s: Invalid src, bg and dst parameters!\n", __func__);
+		return -1;
+	}
+
+	if (!context->blending) {
+		g2d_printf("%s: blending is not enabled!\n", __func__);
+		return -1;
+	}
+
+	if (bg->right - bg->left != dst->right - dst->left ||
+	    bg->bottom - bg->top != dst->bottom - dst->top ||
+	    bg->width > bg->stride || !bg->planes[0]) {
+		g2d_printf("%s: Invalid bg rect, left %d, top %d, right %d, bottom %d, width %d, stride %d!\n",
+				__FUNCTION__, bg->left, bg->top, bg->right, bg->bottom, bg->width, bg->stride);
+		return -1;
+	}
+
+	if (g2d_is_yuv(bg->format) || dst->rot != G2D_ROTATION_0) {
+		g2d_printf("%s: unsupported bg format %d or rotation %d!\n",
+				__func__, bg->format, dst->rot);
+		return -1;
+	}
+
+	return g2d_blit_internal(handle, src, bg, dst);
+}
+
 int g2d_flush(void *handle)
 {
 	int ret;
@@ -880,3 +1006,24 @@ int g2d_finish(void *handle)
 	return 0;
 }
 
+/* wait for tasks committed by g2d_flush to complete. */
+int g2d_wait(void *handle)
+{
+	int ret;
+	struct g2dContext *context = (struct g2dContext *)handle;
+	struct pxp_chan_handle chan_handle;
+
+	if (context == NULL) {
+		g2d_printf("%s: Invalid handle!\n", __func__);
+		return -1;
+	}
+
+	chan_handle.handle = context->handle;
+	ret = ioctl(fd, PXP_IOC_WAIT4CMPLT, &chan_handle);
+	if (ret < 0) {
+		g2d_printf("%s: failed to wait task complete\n", __func__);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ *  Copyright 2017 NXP.
+ *  All Rights Reserved.
+ * 2018 zaferkaya1960@hotmail.com
+ *
+ *  The following programs are the sole property of Freescale Semiconductor Inc.,
+ *  and contain its proprietary and confidential information.
+ *
+ */
+
+#ifndef __G2D_CLIP_H__
+#define __G2D_CLIP_H__
+
+/*
+ * Clip mapping shared by libg2d and its users, g2d.h must be included
+ * first. Shrinks src to the part read for the dst area [x0,x1) x [y0,y1),
+ * given relative to the dst rect, honouring dst rotation and the flips
+ * of src and dst. Source edges are rounded outwards.
+ */
+static inline void g2d_clip_source(struct g2d_surface *src,
+				   const struct g2d_surface *dst,
+				   int x0, int y0, int x1, int y1)
+{
+	int dw, dh, sw, sh;
+	int u0, u1, du, v0, v1, dv, t;
+
+	dw = dst->right - dst->left;
+	dh = dst->bottom - dst->top;
+
+	/* clip edges along source axes, in dst pixels */
+	switch (dst->rot) {
+	case G2D_ROTATION_90:
+		u0 = y0; u1 = y1; du = dh;
+		v0 = dw - x1; v1 = dw - x0; dv = dw;
+		break;
+	case G2D_ROTATION_270:
+		u0 = dh - y1; u1 = dh - y0; du = dh;
+		v0 = x0; v1 = x1; dv = dw;
+		break;
+	case G2D_ROTATION_180:
+		u0 = dw - x1; u1 = dw - x0; du = dw;
+		v0 = dh - y1; v1 = dh - y0; dv = dh;
+		break;
+	default:
+		u0 = x0; u1 = x1; du = dw;
+		v0 = y0; v1 = y1; dv = dh;
+		break;
+	}
+
+	if (src->rot == G2D_FLIP_H || dst->rot == G2D_FLIP_H) {
+		t = u0; u0 = du - u1; u1 = du - t;
+	}
+	if (src->rot == G2D_FLIP_V || dst->rot == G2D_FLIP_V) {
+		t = v0; v0 = dv - v1; v1 = dv - t;
+	}
+
+	sw = src->right - src->left;
+	sh = src->bottom - src->top;
+	src->right  = src->left + (u1 * sw + du - 1) / du;
+	src->bottom = src->top + (v1 * sh + dv - 1) / dv;
+	src->left  += u0 * sw / du;
+	src->top   += v0 * sh / dv;
+}
+
+#endif /* __G2D_CLIP_H__ */
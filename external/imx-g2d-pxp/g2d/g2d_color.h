@@ -0,0 +1,54 @@
+/*
+ *  Copyright 2017 NXP.
+ *  All Rights Reserved.
+ * 2018 zaferkaya1960@hotmail.com
+ *
+ *  The following programs are the sole property of Freescale Semiconductor Inc.,
+ *  and contain its proprietary and confidential information.
+ *
+ */
+
+#ifndef __G2D_COLOR_H__
+#define __G2D_COLOR_H__
+
+/*
+ * Fill color conversion shared by libg2d and its users, g2d.h must be
+ * included first. clrcolor is RGBA8888, red in the low byte and alpha in
+ * the top one. Returns the pixel value of the color in format, 16 bit
+ * pixels are repeated in both halves. Formats without a fill value,
+ * YUV ones, get the color unchanged.
+ */
+static inline unsigned int g2d_pack_color(unsigned int color,
+					  enum g2d_format format)
+{
+	unsigned int r = color & 0xff;
+	unsigned int g = (color >> 8) & 0xff;
+	unsigned int b = (color >> 16) & 0xff;
+	unsigned int a = color >> 24;
+	unsigned int p;
+
+	switch (format) {
+	case G2D_RGBA8888:
+	case G2D_RGBX8888:
+		return color;
+	case G2D_BGRA8888:
+	case G2D_BGRX8888:
+		return (a << 24) | (r << 16) | (g << 8) | b;
+	case G2D_ARGB8888:
+	case G2D_XRGB8888:
+		return (b << 24) | (g << 16) | (r << 8) | a;
+	case G2D_ABGR8888:
+	case G2D_XBGR8888:
+		return (r << 24) | (g << 16) | (b << 8) | a;
+	case G2D_RGB565:
+		p = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+		return (p << 16) | p;
+	case G2D_BGR565:
+		p = ((b >> 3) << 11) | ((g >> 2) << 5) | (r >> 3);
+		return (p << 16) | p;
+	default:
+		return color;
+	}
+}
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ *  Copyright 2017 NXP.
+ *  All Rights Reserved.
+ * 2018 zaferkaya1960@hotmail.com
+ *
+ *  The following programs are the sole property of Freescale Semiconductor Inc.,
+ *  and contain its proprietary and confidential information.
+ *
+ */
+
+#ifndef __G2D_FORMAT_TRAITS_H__
+#define __G2D_FORMAT_TRAITS_H__
+
+/*
+ * Pixel format table shared by libg2d and its users, so that the pxp
+ * format, the stride bits and the plane layout of a g2d format are
+ * defined once. Users define
+ * G2D_FORMAT(format, pxp, bpp, bits, layout, yuv, hal) and expand
+ * G2D_FORMAT_TABLE:
+ *   pxp:    PXP_PIX_FMT_* the format maps to, 0 if pxp can't handle it.
+ *   bpp:    bits per pixel of the first plane, used for stride.
+ *   bits:   bits per pixel of all planes, used for memory traffic.
+ *   layout: G2D_LAYOUT_* position of the chroma planes.
+ *   yuv:    1 for YUV formats, 0 for RGB ones.
+ *   hal:    FORMAT_* of the display HAL mapped to the format, 0 if none.
+ *           Only the composer expands it, libg2d ignores the column.
+ */
+
+#define G2D_LAYOUT_PACKED	0
+/* one interleaved chroma plane following luma */
+#define G2D_LAYOUT_SEMIPLANAR	1
+/* U plane then V plane following luma */
+#define G2D_LAYOUT_PLANAR_UV	2
+/* V plane then U plane following luma */
+#define G2D_LAYOUT_PLANAR_VU	3
+
+#ifdef BUILD_FOR_ANDROID
+#define G2D_PXP_RGB565		PXP_PIX_FMT_RGB565
+#define G2D_PXP_RGBA8888	PXP_PIX_FMT_ARGB32
+#define G2D_PXP_RGBX8888	PXP_PIX_FMT_XRGB32
+#else
+#define G2D_PXP_RGB565		PXP_PIX_FMT_BGR565
+#define G2D_PXP_RGBA8888	PXP_PIX_FMT_ABGR32
+#define G2D_PXP_RGBX8888	PXP_PIX_FMT_XBGR32
+#endif
+
+#define G2D_FORMAT_TABLE \
+	G2D_FORMAT(G2D_RGB565,   G2D_PXP_RGB565,       16, 16, G2D_LAYOUT_PACKED, 0, FORMAT_RGB565)   \
+	G2D_FORMAT(G2D_BGR565,   PXP_PIX_FMT_RGB565,   16, 16, G2D_LAYOUT_PACKED, 0, 0)               \
+	G2D_FORMAT(G2D_BGRX8888, PXP_PIX_FMT_XRGB32,   32, 32, G2D_LAYOUT_PACKED, 0, 0)               \
+	G2D_FORMAT(G2D_BGRA8888, PXP_PIX_FMT_ARGB32,   32, 32, G2D_LAYOUT_PACKED, 0, FORMAT_BGRA8888) \
+	G2D_FORMAT(G2D_XRGB8888, PXP_PIX_FMT_BGRX32,   32, 32, G2D_LAYOUT_PACKED, 0, 0)               \
+	G2D_FORMAT(G2D_ARGB8888, PXP_PIX_FMT_BGRA32,   32, 32, G2D_LAYOUT_PACKED, 0, 0)               \
+	G2D_FORMAT(G2D_RGBA8888, G2D_PXP_RGBA8888,     32, 32, G2D_LAYOUT_PACKED, 0, FORMAT_RGBA8888) \
+	G2D_FORMAT(G2D_RGBX8888, G2D_PXP_RGBX8888,     32, 32, G2D_LAYOUT_PACKED, 0, FORMAT_RGBX8888) \
+	G2D_FORMAT(G2D_ABGR8888, 0,                    32, 32, G2D_LAYOUT_PACKED, 0, 0)               \
+	G2D_FORMAT(G2D_XBGR8888, 0,                    32, 32, G2D_LAYOUT_PACKED, 0, 0)               \
+	G2D_FORMAT(G2D_UYVY,     PXP_PIX_FMT_UYVY,     16, 16, G2D_LAYOUT_PACKED, 1, 0)               \
+	G2D_FORMAT(G2D_VYUY,     PXP_PIX_FMT_VYUY,     16, 16, G2D_LAYOUT_PACKED, 1, 0)               \
+	G2D_FORMAT(G2D_YUYV,     PXP_PIX_FMT_YUYV,     16, 16, G2D_LAYOUT_PACKED, 1, FORMAT_YUYV)     \
+	G2D_FORMAT(G2D_YVYU,     PXP_PIX_FMT_YVYU,     16, 16, G2D_LAYOUT_PACKED, 1, 0)               \
+	G2D_FORMAT(G2D_I420,     PXP_PIX_FMT_YUV420P,   8, 12, G2D_LAYOUT_PLANAR_UV, 1, FORMAT_I420)  \
+	G2D_FORMAT(G2D_YV12,     PXP_PIX_FMT_YVU420P,   8, 12, G2D_LAYOUT_PLANAR_VU, 1, FORMAT_YV12)  \
+	G2D_FORMAT(G2D_NV12,     PXP_PIX_FMT_NV12,      8, 12, G2D_LAYOUT_SEMIPLANAR, 1, FORMAT_NV12) \
+	G2D_FORMAT(G2D_NV21,     PXP_PIX_FMT_NV21,      8, 12, G2D_LAYOUT_SEMIPLANAR, 1, FORMAT_NV21) \
+	G2D_FORMAT(G2D_NV16,     PXP_PIX_FMT_NV16,      8, 16, G2D_LAYOUT_SEMIPLANAR, 1, FORMAT_NV16) \
+	G2D_FORMAT(G2D_NV61,     PXP_PIX_FMT_NV61,      8, 16, G2D_LAYOUT_SEMIPLANAR, 1, 0)
+
+#endif
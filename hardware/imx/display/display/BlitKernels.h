@@ -0,0 +1,252 @@
+/*
+ * Copyright 2017 NXP.
+ * 2018 zaferkaya1960@hotmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FSL_BLIT_KERNELS_H_
+#define _FSL_BLIT_KERNELS_H_
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BLIT_KERNELS_NEON 1
+#endif
+
+namespace fsl {
+
+// row kernels for blits too small to pay for a PXP task. 32 bit pixels
+// keep alpha in the top byte, color channels are treated alike so both
+// RGBA and BGRA orders work as long as source and target agree.
+
+// x * y / 255, rounded.
+static inline uint32_t mulDiv255(uint32_t x, uint32_t y)
+{
+    uint32_t t = x * y + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static inline void fillRow32(uint32_t* dst, uint32_t color, int count)
+{
+    int i = 0;
+#ifdef BLIT_KERNELS_NEON
+    uint32x4_t c = vdupq_n_u32(color);
+    for (; i + 8 <= count; i += 8) {
+        vst1q_u32(dst + i, c);
+        vst1q_u32(dst + i + 4, c);
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = color;
+    }
+}
+
+static inline void fillRow16(uint16_t* dst, uint16_t color, int count)
+{
+    int i = 0;
+#ifdef BLIT_KERNELS_NEON
+    uint16x8_t c = vdupq_n_u16(color);
+    for (; i + 8 <= count; i += 8) {
+        vst1q_u16(dst + i, c);
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = color;
+    }
+}
+
+// copy count pixels, reversed for horizontal flip.
+static inline void copyRow32(uint32_t* dst, const uint32_t* src, int count,
+                             bool reverse)
+{
+    if (!reverse) {
+        memcpy(dst, src, count * 4);
+        return;
+    }
+
+    int i = 0;
+#ifdef BLIT_KERNELS_NEON
+    for (; i + 4 <= count; i += 4) {
+        uint32x4_t v = vld1q_u32(src + count - i - 4);
+        v = vrev64q_u32(v);
+        vst1q_u32(dst + i, vcombine_u32(vget_high_u32(v), vget_low_u32(v)));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = src[count - 1 - i];
+    }
+}
+
+static inline void copyRow16(uint16_t* dst, const uint16_t* src, int count,
+                             bool reverse)
+{
+    if (!reverse) {
+        memcpy(dst, src, count * 2);
+        return;
+    }
+
+    int i = 0;
+#ifdef BLIT_KERNELS_NEON
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t v = vld1q_u16(src + count - i - 8);
+        v = vrev64q_u16(v);
+        vst1q_u16(dst + i, vcombine_u16(vget_high_u16(v), vget_low_u16(v)));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = src[count - 1 - i];
+    }
+}
+
+static inline uint32_t blendPixel32(uint32_t d, uint32_t s, uint32_t alpha,
+                                    bool premult)
+{
+    uint32_t fa = mulDiv255(s >> 24, alpha);
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t sc = (s >> shift) & 0xff;
+        uint32_t dc = (d >> shift) & 0xff;
+        // source over: Fs is global alpha or source alpha, Fd is 1 - As.
+        uint32_t c = mulDiv255(sc, premult ? alpha : fa) +
+                     mulDiv255(dc, 255 - fa);
+        out |= (c > 255 ? 255 : c) << shift;
+    }
+    return out;
+}
+
+// blend count source pixels over dst with global alpha, source alpha is
+// taken as opaque for sources without alpha.
+static inline void blendRow32(uint32_t* dst, const uint32_t* src, int count,
+                              uint32_t alpha, bool premult, bool opaque)
+{
+    int i = 0;
+#ifdef BLIT_KERNELS_NEON
+    uint8x8_t ga = vdup_n_u8(alpha);
+    uint8x8_t full = vdup_n_u8(255);
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t s = vld4_u8((const uint8_t*)(src + i));
+        uint8x8x4_t d = vld4_u8((const uint8_t*)(dst + i));
+        if (opaque) {
+            s.val[3] = full;
+        }
+
+        uint16x8_t t = vmull_u8(s.val[3], ga);
+        uint8x8_t fa = vraddhn_u16(t, vrshrq_n_u16(t, 8));
+        uint8x8_t fs = premult ? ga : fa;
+        uint8x8_t fd = vsub_u8(full, fa);
+        for (int c = 0; c < 4; c++) {
+            uint16x8_t ps = vmull_u8(s.val[c], fs);
+            uint16x8_t pd = vmull_u8(d.val[c], fd);
+            d.val[c] = vqadd_u8(vraddhn_u16(ps, vrshrq_n_u16(ps, 8)),
+                                vraddhn_u16(pd, vrshrq_n_u16(pd, 8)));
+        }
+        vst4_u8((uint8_t*)(dst + i), d);
+    }
+#endif
+    for (; i < count; i++) {
+        uint32_t s = opaque ? (src[i] | 0xff000000) : src[i];
+        dst[i] = blendPixel32(dst[i], s, alpha, premult);
+    }
+}
+
+// rotations are done in 8x8 tiles, walked in 64x64 blocks so the source
+// lines of a block stay in cache while its tiles are transposed.
+#define ROTATE_TILE 8
+#define ROTATE_BLOCK 64
+
+// dst row c gets element c of each source row, for cols x rows pixels.
+// pitch is in pixels and may be negative to store rows bottom up.
+static inline void transposeTile32(uint32_t* dst, int pitch,
+                                   const uint32_t* const* rows, int count,
+                                   int cols)
+{
+#ifdef BLIT_KERNELS_NEON
+    if (count == ROTATE_TILE && cols == ROTATE_TILE) {
+        for (int k = 0; k < ROTATE_TILE; k += 4) {
+            for (int c = 0; c < ROTATE_TILE; c += 4) {
+                uint32x4x2_t t0 = vtrnq_u32(vld1q_u32(rows[k] + c),
+                                            vld1q_u32(rows[k + 1] + c));
+                uint32x4x2_t t1 = vtrnq_u32(vld1q_u32(rows[k + 2] + c),
+                                            vld1q_u32(rows[k + 3] + c));
+                uint32_t* out = dst + c * pitch + k;
+                vst1q_u32(out, vcombine_u32(vget_low_u32(t0.val[0]),
+                                            vget_low_u32(t1.val[0])));
+                vst1q_u32(out + pitch, vcombine_u32(vget_low_u32(t0.val[1]),
+                                                    vget_low_u32(t1.val[1])));
+                vst1q_u32(out + 2 * pitch, vcombine_u32(vget_high_u32(t0.val[0]),
+                                                        vget_high_u32(t1.val[0])));
+                vst1q_u32(out + 3 * pitch, vcombine_u32(vget_high_u32(t0.val[1]),
+                                                        vget_high_u32(t1.val[1])));
+            }
+        }
+        return;
+    }
+#endif
+    for (int c = 0; c < cols; c++) {
+        uint32_t* out = dst + c * pitch;
+        for (int k = 0; k < count; k++) {
+            out[k] = rows[k][c];
+        }
+    }
+}
+
+// rotate a width x height target area out of src, rot is 90, 180 or 270
+// degrees clockwise. pitches are in pixels.
+static inline void rotateRect32(uint32_t* dst, int dpitch, const uint32_t* src,
+                                int spitch, int width, int height, int rot)
+{
+    if (rot == 180) {
+        for (int y = 0; y < height; y++) {
+            copyRow32(dst + y * dpitch, src + (height - 1 - y) * spitch,
+                      width, true);
+        }
+        return;
+    }
+
+    // source is height x width, target rows are source columns.
+    const uint32_t* rows[ROTATE_TILE];
+    for (int by = 0; by < height; by += ROTATE_BLOCK) {
+        int bh = (height - by < ROTATE_BLOCK) ? height - by : ROTATE_BLOCK;
+        for (int bx = 0; bx < width; bx += ROTATE_BLOCK) {
+            int bw = (width - bx < ROTATE_BLOCK) ? width - bx : ROTATE_BLOCK;
+            for (int ty = by; ty < by + bh; ty += ROTATE_TILE) {
+                int th = (by + bh - ty < ROTATE_TILE) ? by + bh - ty : ROTATE_TILE;
+                for (int tx = bx; tx < bx + bw; tx += ROTATE_TILE) {
+                    int tw = (bx + bw - tx < ROTATE_TILE) ? bx + bw - tx :
+                                                            ROTATE_TILE;
+                    if (rot == 90) {
+                        // target (x, y) is source (y, width - 1 - x).
+                        for (int k = 0; k < tw; k++) {
+                            rows[k] = src + (width - 1 - tx - k) * spitch + ty;
+                        }
+                        transposeTile32(dst + ty * dpitch + tx, dpitch, rows,
+                                        tw, th);
+                    }
+                    else {
+                        // target (x, y) is source (height - 1 - y, x).
+                        for (int k = 0; k < tw; k++) {
+                            rows[k] = src + (tx + k) * spitch + height - ty - th;
+                        }
+                        transposeTile32(dst + (ty + th - 1) * dpitch + tx,
+                                        -dpitch, rows, tw, th);
+                    }
+                }
+            }
+        }
+    }
+}
+
+}
+#endif
@@ -15,8 +15,16 @@
  * limitations under the License.
  */
 #include <dlfcn.h>
+#include <cutils/properties.h>
+#include <utils/KeyedVector.h>
+#include <utils/Timers.h>
+#include <g2d_format_traits.h>
+#include <g2d_clip.h>
+#include <g2d_color.h>
+#include "BlitKernels.h"
 #include "Composer.h"
 #include "MemoryManager.h"
+#include "SoftEngine.h"
 #include <system/window.h>
 
 #if defined(__LP64__)
@@ -28,19 +36,191 @@
 #define GPUHELPER "libgpuhelper.so"
 #define GPUENGINE "libg2d.so"
 
+// rotation buffers are allocated in 64 pixel size classes so that layers
+// with slightly different sizes share the same buffer.
+#define ROT_POOL_ALIGN 64
+// release rotation buffers not used for about two seconds at 60 fps.
+#define ROT_POOL_IDLE_FRAMES 120
+// default upper bound of memory held by the rotation pool, it can be
+// changed in MB by hwc.pxp.scratch_mb.
+#define ROT_POOL_MAX_BYTES (16 * 1024 * 1024)
+// the scratch arena takes at most this part of the pool budget.
+#define ROT_ARENA_SHARE 4
+
+// the PXP rotation engine works on 8x8 pixel blocks.
+#define ROT_BLOCK_SIZE 8
+
+// translucent solid layers scale this small black buffer as source.
+#define DIM_BUFFER_SIZE 16
+
+// cost of one PXP task and CPU blit rate assumed until they are measured,
+// in ns and pixels per us.
+#define PXP_DEFAULT_TASK_COST 40000
+#define CPU_DEFAULT_RATE 150
+// CPU never blits more pixels than this, whatever the measured costs.
+#define CPU_BLIT_MAX_PIXELS (16 * 1024)
+// rotated blits this large are split in stripes between PXP and CPU.
+#define LOAD_SPLIT_MIN_PIXELS (256 * 1024)
+// CPU share of a split blit in 1/1024, initial value and bounds.
+#define LOAD_SHARE_DEFAULT 256
+#define LOAD_SHARE_MIN 64
+#define LOAD_SHARE_MAX 512
+// engine waits shorter than this count as finished together, in ns.
+#define LOAD_WAIT_SLACK 200000
+
+#define ALIGN_PIXEL(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
 namespace fsl {
 
+// per format constants from the table shared with libg2d.
+template <enum g2d_format format> struct FormatTraits;
+#define G2D_FORMAT(fmt, pxp, bpp, bits, layout, yuv, hal)             \
+    template <> struct FormatTraits<fmt> {                            \
+        enum { BPP = bpp, BITS = bits, LAYOUT = layout, YUV = yuv };   \
+    };
+G2D_FORMAT_TABLE
+#undef G2D_FORMAT
+
+static Rect getSurfaceRect(const struct g2d_surface& surface)
+{
+    return Rect(surface.left, surface.top, surface.right, surface.bottom);
+}
+
+static void setSurfaceRect(struct g2d_surface& surface, const Rect& rect)
+{
+    surface.left = rect.left;
+    surface.top = rect.top;
+    surface.right = rect.right;
+    surface.bottom = rect.bottom;
+}
+
+static int getFormatBits(enum g2d_format format)
+{
+    switch (format) {
+#define G2D_FORMAT(fmt, pxp, bpp, bits, layout, yuv, hal)             \
+        case fmt:                                                     \
+            return FormatTraits<fmt>::BITS;
+        G2D_FORMAT_TABLE
+#undef G2D_FORMAT
+        default:
+            return 32;
+    }
+}
+
+static bool isYuvFormat(int format)
+{
+    switch (format) {
+#define G2D_FORMAT(fmt, pxp, bpp, bits, layout, yuv, hal)             \
+        case fmt:                                                     \
+            return FormatTraits<fmt>::YUV != 0;
+        G2D_FORMAT_TABLE
+#undef G2D_FORMAT
+        default:
+            return false;
+    }
+}
+
+// chroma plane addresses of a format, the layout switch is resolved when
+// the builder is instantiated.
+typedef void (*SurfaceBuilder)(struct g2d_surface& surface, int height,
+                               int alignHeight);
+
+template <enum g2d_format format>
+static void buildPlanes(struct g2d_surface& surface, int height,
+                        int alignHeight)
+{
+    int c_stride = (surface.stride/2+15)/16*16;
+    switch (FormatTraits<format>::LAYOUT) {
+        case G2D_LAYOUT_SEMIPLANAR:
+            surface.planes[1] = surface.planes[0] + surface.stride * alignHeight;
+            break;
+
+        case G2D_LAYOUT_PLANAR_UV:
+            surface.planes[1] = surface.planes[0] + surface.stride * height;
+            surface.planes[2] = surface.planes[1] + c_stride * height/2;
+            break;
+
+        case G2D_LAYOUT_PLANAR_VU:
+            surface.planes[2] = surface.planes[0] + surface.stride * height;
+            surface.planes[1] = surface.planes[2] + c_stride * height/2;
+            break;
+
+        default:
+            break;
+    }
+}
+
+static SurfaceBuilder getSurfaceBuilder(enum g2d_format format)
+{
+    switch (format) {
+#define G2D_FORMAT(fmt, pxp, bpp, bits, layout, yuv, hal)             \
+        case fmt:                                                     \
+            return &buildPlanes<fmt>;
+        G2D_FORMAT_TABLE
+#undef G2D_FORMAT
+        default:
+            return NULL;
+    }
+}
+
 Composer::Composer()
 {
     mTarget = NULL;
     mDimBuffer = NULL;
+    mDimColor = 0;
     mRotBuffer = NULL;
-    N = 0;
+    mFuseBottom = NULL;
+    mFrameTarget = NULL;
+    mFrameTransform = 0;
+    mFramePool = -1;
+    mAtlasPool = -1;
+    mArenaPool = -1;
+    mAtlasBottom = 0;
+    mAtlasUsers = 0;
+    mRotLeft = mRotTop = 0;
+    mHoleValid = false;
+    mHoleMode = 0;
+    mGeometryChanged = true;
+    for (int i = 0; i < TARGET_AGE_SIZE; i++) {
+        mHoleStates[i].target = NULL;
+        mHoleStates[i].frame = 0;
+    }
+    mTaskCost = PXP_DEFAULT_TASK_COST;
+    mFrameTasks = 0;
+    mFramePixels = 0;
+    mSubmitStart = 0;
+    mCpuRate = CPU_DEFAULT_RATE;
+    mCpuShare = LOAD_SHARE_DEFAULT;
+    mQueueHead = 0;
+    mQueueTail = 0;
+    mLayerSkipped = false;
+    for (int i = 0; i < FRAME_QUEUE_SIZE; i++) {
+        mFrames[i].targetPlane = 0;
+    }
     mHandle = NULL;
-
-    for (int i = 0; i < 64; i++)
-	mRotBuffers[i] = NULL;
-
+    mRotPoolBytes = 0;
+    char value[PROPERTY_VALUE_MAX];
+    property_get("hwc.pxp.scratch_mb", value, "0");
+    mRotPoolBudget = atoi(value) * 1024 * 1024;
+    if (mRotPoolBudget <= 0) {
+        mRotPoolBudget = ROT_POOL_MAX_BYTES;
+    }
+    mFrameCount = 0;
+    memset(&mRotPool[0], 0, sizeof(mRotPool));
+    for (int i = 0; i < ROT_CACHE_SIZE; i++) {
+        mRotCache[i].source = NULL;
+        mRotCache[i].pool = -1;
+        mRotCache[i].atlas = false;
+        mRotCache[i].filled = false;
+        mRotCache[i].lastFrame = 0;
+    }
+    mDamageValid = false;
+    memset(&mTargetAges[0], 0, sizeof(mTargetAges));
+    memset(&mSurfaceCache[0], 0, sizeof(mSurfaceCache));
+    for (int i = 0; i < CAP_STATE_SIZE; i++) {
+        mCapState[i] = -1;
+    }
+    mClipValid = false;
 
     char path[PATH_MAX] = {0};
     snprintf(path, PATH_MAX, "%s/%s", LIB_PATH, GPUHELPER);
@@ -66,17 +246,40 @@ Composer::Composer()
     memset(path, 0, sizeof(path));
     snprintf(path, PATH_MAX, "%s/%s", LIB_PATH, GPUENGINE);
 
+    mSoftware = false;
+    property_get("hwc.soft.compose", value, "1");
     handle = dlopen(path, RTLD_NOW);
-    if (handle == NULL) {
+    // surface planes are int, CPU addresses only fit on 32 bit.
+    if (handle == NULL && atoi(value) != 0 && sizeof(void*) == sizeof(int)) {
+        ALOGI("no %s found, switch to CPU composite", path);
+        mSoftware = true;
+        mSetClipping = &SoftEngine::setClipping;
+        mBlitFunction = &SoftEngine::blit;
+        mCompositeFunction = &SoftEngine::composite;
+        mOpenEngine = &SoftEngine::open;
+        mCloseEngine = &SoftEngine::close;
+        mClearFunction = &SoftEngine::clear;
+        mEnableFunction = &SoftEngine::enable;
+        mDisableFunction = &SoftEngine::disable;
+        mFinishEngine = &SoftEngine::finish;
+        mFlushEngine = NULL;
+        mWaitEngine = NULL;
+        mQueryFeature = NULL;
+        openEngine(&mHandle);
+    }
+    else if (handle == NULL) {
         ALOGI("no %s found, switch to 3D composite", path);
         mSetClipping = NULL;
         mBlitFunction = NULL;
+        mCompositeFunction = NULL;
         mOpenEngine = NULL;
         mCloseEngine = NULL;
         mClearFunction = NULL;
         mEnableFunction = NULL;
         mDisableFunction = NULL;
         mFinishEngine = NULL;
+        mFlushEngine = NULL;
+        mWaitEngine = NULL;
         mQueryFeature = NULL;
     }
     else {
@@ -85,28 +288,44 @@ Composer::Composer()
         if (mBlitFunction == NULL) {
             mBlitFunction = (hwc_func3)dlsym(handle, "g2d_blit");
         }
+        mCompositeFunction = (hwc_func4)dlsym(handle, "g2d_blit_composite");
         mOpenEngine = (hwc_func1)dlsym(handle, "g2d_open");
         mCloseEngine = (hwc_func1)dlsym(handle, "g2d_close");
         mClearFunction = (hwc_func2)dlsym(handle, "g2d_clear");
         mEnableFunction = (hwc_func2)dlsym(handle, "g2d_enable");
         mDisableFunction = (hwc_func2)dlsym(handle, "g2d_disable");
         mFinishEngine = (hwc_func1)dlsym(handle, "g2d_finish");
+        mFlushEngine = (hwc_func1)dlsym(handle, "g2d_flush");
+        mWaitEngine = (hwc_func1)dlsym(handle, "g2d_wait");
         mQueryFeature = (hwc_func3)dlsym(handle, "g2d_query_feature");
         openEngine(&mHandle);
     }
+
+    if (mHandle != NULL) {
+        mWorker = new ComposeThread(this);
+    }
 }
 
 Composer::~Composer()
 {
+    waitComposite();
+    if (mWorker != NULL) {
+        mWorker->requestExit();
+        mWorker->signal();
+        mWorker->join();
+        mWorker = NULL;
+    }
+
     MemoryManager* pManager = MemoryManager::getInstance();
     if (mDimBuffer != NULL) {
         pManager->releaseMemory(mDimBuffer);
     }
 
-    for (int i = 0; i < N; i++)
-	if (mRotBuffers[i] != NULL) {
-		pManager->releaseMemory(mRotBuffers[i]);
-	}
+    for (int i = 0; i < ROT_POOL_SIZE; i++) {
+        if (mRotPool[i].memory != NULL) {
+            pManager->releaseMemory(mRotPool[i].memory);
+        }
+    }
 
     if (mHandle != NULL) {
         closeEngine(mHandle);
@@ -127,589 +346,2942 @@ int Composer::checkDimBuffer()
         return 0;
     }
 
-    if ((mDimBuffer != NULL) && (mTarget->width == mDimBuffer->width &&
-        mTarget->height == mDimBuffer->height &&
-        mTarget->fslFormat == mDimBuffer->fslFormat)) {
+    if ((mDimBuffer != NULL) &&
+        (mTarget->fslFormat == mDimBuffer->fslFormat)) {
         return 0;
     }
 
     MemoryManager* pManager = MemoryManager::getInstance();
     if (mDimBuffer != NULL) {
+        // queued frames may still read the old dim buffer.
+        waitComposite();
         pManager->releaseMemory(mDimBuffer);
+        mDimBuffer = NULL;
     }
 
     MemoryDesc desc;
-    desc.mWidth = mTarget->width;
-    desc.mHeight = mTarget->height;
+    desc.mWidth = DIM_BUFFER_SIZE;
+    desc.mHeight = DIM_BUFFER_SIZE;
     desc.mFormat = mTarget->format;
     desc.mFslFormat = mTarget->fslFormat;
     desc.mProduceUsage |= USAGE_HW_COMPOSER |
                           USAGE_HW_2D | USAGE_HW_RENDER;
+    if (mSoftware) {
+        desc.mProduceUsage |= USAGE_SW_READ_OFTEN | USAGE_SW_WRITE_OFTEN;
+    }
     desc.checkFormat();
     int ret = pManager->allocMemory(desc, &mDimBuffer);
+    if (ret == 0 && !isCpuMapped(mDimBuffer)) {
+        pManager->releaseMemory(mDimBuffer);
+        mDimBuffer = NULL;
+        ret = -ENOMEM;
+    }
     if (ret == 0) {
-        Rect rect;
-        rect.left = rect.top = 0;
-        rect.right = mTarget->width;
-        rect.bottom = mTarget->height;
+        Rect rect(DIM_BUFFER_SIZE, DIM_BUFFER_SIZE);
         clearRect(mDimBuffer, rect);
+        mDimColor = 0xff << 24;
     }
 
     return ret;
 }
 
+void Composer::setDimColor(uint32_t color)
+{
+    // fills are executed in order with the blits reading the buffer, so
+    // it is only refilled when the color changes.
+    if (mDimBuffer == NULL || color == mDimColor) {
+        return;
+    }
+
+    Rect rect(DIM_BUFFER_SIZE, DIM_BUFFER_SIZE);
+    fillRect(mDimBuffer, rect, color);
+    mDimColor = color;
+}
+
 int Composer::allocRotBuffer(int width, int height, int transform)
 {
     mRotBuffer = NULL;
+    mRotLeft = mRotTop = 0;
 
     if (mTarget == NULL) return 0;
 
-    MemoryDesc desc;
+    int w = transform ? height : width;
+    int h = transform ? width  : height;
+    if (reserveArena() == 0) {
+        RotEntry& arena = mRotPool[mArenaPool];
+        if (w <= arena.width && h <= arena.height) {
+            arena.lastUsed = mFrameCount;
+            mRotBuffer = arena.memory;
+            return 0;
+        }
+    }
 
-    desc.mWidth  = transform ? height : width;
-    desc.mHeight = transform ? width  : height; 
+    // larger than the arena, take a pool buffer within the budget.
+    int index = acquireRotBuffer(w, h, false);
+    if (index < 0) {
+        return index;
+    }
 
-    for (int i = 0; i < N; i++) {
-	//if (mRotBuffers[i] != NULL)
-	if ((desc.mWidth <= mRotBuffers[i]->width) &&
-	    (desc.mHeight <= mRotBuffers[i]->height) &&
-	    (mTarget->fslFormat == mRotBuffers[i]->fslFormat)) {
-		mRotBuffer = mRotBuffers[i];
-        	return 0;
-	}
+    mRotBuffer = mRotPool[index].memory;
+    return 0;
+}
+
+int Composer::reserveArena()
+{
+    if (mArenaPool >= 0) {
+        if (mRotPool[mArenaPool].format == mTarget->fslFormat) {
+            return 0;
+        }
+        mRotPool[mArenaPool].pinned = false;
+        mArenaPool = -1;
     }
 
-    if (N == 64) return 0;
+    // scratch of one pass is reused by the next one, since blits are
+    // executed in order. one reserved buffer serves all layers, wide
+    // enough for a rotated screen and as high as the budget allows.
+    int width = (mTarget->width > mTarget->height) ?
+                 mTarget->width : mTarget->height;
+    width = ALIGN_PIXEL(width, ROT_POOL_ALIGN);
+    int bpp = (mTarget->fslFormat == FORMAT_RGB565) ? 2 : 4;
+    int height = mRotPoolBudget / ROT_ARENA_SHARE / (width * bpp);
+    height = height / ROT_POOL_ALIGN * ROT_POOL_ALIGN;
+    if (height > width) {
+        height = width;
+    }
+    if (height < ROT_POOL_ALIGN) {
+        height = ROT_POOL_ALIGN;
+    }
 
-    desc.mFormat = mTarget->format;
-    desc.mFslFormat = mTarget->fslFormat;
+    int index = acquireRotBuffer(width, height, true);
+    if (index < 0) {
+        return index;
+    }
+
+    mArenaPool = index;
+    return 0;
+}
+
+int Composer::getArenaRows(int width)
+{
+    if (mTarget == NULL || reserveArena() != 0) {
+        return 0;
+    }
+
+    RotEntry& arena = mRotPool[mArenaPool];
+    return (width <= arena.width) ? arena.height : 0;
+}
+
+int Composer::acquireRotBuffer(int width, int height, bool pinned)
+{
+    int format = mTarget->fslFormat;
+
+    // best fit in the pool. blits are executed in order by the 2D engine,
+    // so layers of the same frame can share one rotation buffer.
+    int index = -1;
+    for (int i = 0; i < ROT_POOL_SIZE; i++) {
+        RotEntry& entry = mRotPool[i];
+        if (entry.memory == NULL || entry.pinned || entry.format != format ||
+            width > entry.width || height > entry.height) {
+            continue;
+        }
 
-    //ALOGE("allocRotBuffer mFormat:0x%x, mFslFormat:0x%x, mWidth:%d, mHeight:%d", desc.mFormat, desc.mFslFormat, desc.mWidth, desc.mHeight);
+        if (index < 0 || entry.bytes < mRotPool[index].bytes) {
+            index = i;
+        }
+    }
 
+    if (index >= 0) {
+        mRotPool[index].lastUsed = mFrameCount;
+        mRotPool[index].pinned = pinned;
+        return index;
+    }
 
+    MemoryDesc desc;
+    desc.mWidth  = ALIGN_PIXEL(width, ROT_POOL_ALIGN);
+    desc.mHeight = ALIGN_PIXEL(height, ROT_POOL_ALIGN);
+    desc.mFormat = mTarget->format;
+    desc.mFslFormat = format;
     desc.mProduceUsage |= USAGE_HW_COMPOSER | USAGE_HW_2D | USAGE_HW_RENDER;
+    if (mSoftware) {
+        desc.mProduceUsage |= USAGE_SW_READ_OFTEN | USAGE_SW_WRITE_OFTEN;
+    }
     desc.checkFormat();
 
+    int bpp = (format == FORMAT_RGB565) ? 2 : 4;
+    int bytes = desc.mWidth * desc.mHeight * bpp;
+    if (mRotPoolBytes + bytes > mRotPoolBudget) {
+        // only buffers not referenced by the current frame can be freed.
+        evictRotBuffers(1, mRotPoolBytes + bytes - mRotPoolBudget);
+    }
+
+    index = -1;
+    for (int i = 0; i < ROT_POOL_SIZE; i++) {
+        if (mRotPool[i].memory == NULL) {
+            index = i;
+            break;
+        }
+    }
+
+    if (index < 0 || mRotPoolBytes + bytes > mRotPoolBudget) {
+        ALOGE("%s rotation pool exhausted: w:%d, h:%d, used:%d",
+              __func__, desc.mWidth, desc.mHeight, mRotPoolBytes);
+        return -ENOMEM;
+    }
+
     MemoryManager* pManager = MemoryManager::getInstance();
-    int ret = pManager->allocMemory(desc, &mRotBuffers[N]);
-    if (!ret)
-	mRotBuffer = mRotBuffers[N++];
-    return ret;
+    RotEntry& entry = mRotPool[index];
+    int ret = pManager->allocMemory(desc, &entry.memory);
+    if (ret != 0 || entry.memory == NULL) {
+        entry.memory = NULL;
+        return (ret != 0) ? ret : -ENOMEM;
+    }
+    if (!isCpuMapped(entry.memory)) {
+        pManager->releaseMemory(entry.memory);
+        entry.memory = NULL;
+        return -ENOMEM;
+    }
+
+    entry.width = desc.mWidth;
+    entry.height = desc.mHeight;
+    entry.format = format;
+    entry.bytes = bytes;
+    entry.lastUsed = mFrameCount;
+    entry.pinned = pinned;
+    mRotPoolBytes += bytes;
+
+    return index;
 }
 
-int Composer::finishComposite()
+void Composer::evictRotBuffers(uint32_t idleFrames, int bytes)
 {
-    finishEngine(mHandle);
+    MemoryManager* pManager = MemoryManager::getInstance();
 
-    if (N > 0) {
-	    MemoryManager* pManager = MemoryManager::getInstance();
-	    for (int i = 0; i < N; i++)
-		//if (mRotBuffers[i] != NULL) {
-			pManager->releaseMemory(mRotBuffers[i]);
-		//	mRotBuffers[i] = NULL;
-		//}
-    }
+    // release least recently used buffers first.
+    while (bytes > 0) {
+        int index = -1;
+        for (int i = 0; i < ROT_POOL_SIZE; i++) {
+            RotEntry& entry = mRotPool[i];
+            if (entry.memory == NULL || entry.pinned ||
+                mFrameCount - entry.lastUsed < idleFrames) {
+                continue;
+            }
 
-    N = 0; //mRotBuffers[0] == NULL ? 0 : 1;
-    mRotBuffer = NULL;
+            if (index < 0 || entry.lastUsed < mRotPool[index].lastUsed) {
+                index = i;
+            }
+        }
 
-    //ALOGE("finishComposite()");
+        if (index < 0) {
+            break;
+        }
 
-    return 0;
+        RotEntry& entry = mRotPool[index];
+        // queued frames may still read the buffer.
+        waitFrameDone(entry.lastUsed);
+        pManager->releaseMemory(entry.memory);
+        mRotPoolBytes -= entry.bytes;
+        bytes -= entry.bytes;
+        memset(&entry, 0, sizeof(entry));
+    }
 }
 
-int Composer::setRenderTarget(Memory* memory)
+/*
+ * e8151: the rotation engine can't be combined with alpha blending of the
+ * destination and needs the output position and size aligned to its block
+ * size. Only layers meeting these rules can be rotated in a single pass.
+ */
+bool Composer::isRotationSafe(Layer* layer, struct g2d_surface& src,
+                              struct g2d_surface& dst, const Rect& clip,
+                              bool bypass)
 {
-    mTarget = memory;
-    return 0;
+    if (layer->blendMode != BLENDING_NONE && !bypass) {
+        return false;
+    }
+
+    if (layer->planeAlpha != 0xff || src.rot != G2D_ROTATION_0) {
+        return false;
+    }
+
+    if (isYuvFormat(src.format) || isYuvFormat(dst.format)) {
+        return false;
+    }
+
+    // no scaling.
+    if (!isSameSize(src, dst)) {
+        return false;
+    }
+
+    // the engine writes the clipped part of the rect.
+    Rect out(dst.left, dst.top, dst.right, dst.bottom);
+    out.intersect(clip, &out);
+    return (out.left % ROT_BLOCK_SIZE) == 0 &&
+           (out.top % ROT_BLOCK_SIZE) == 0 &&
+           (out.width() % ROT_BLOCK_SIZE) == 0 &&
+           (out.height() % ROT_BLOCK_SIZE) == 0 &&
+           (dst.stride % ROT_BLOCK_SIZE) == 0;
 }
 
-int Composer::clearRect(Memory* target, Rect& rect)
+int Composer::checkRotCache(Layer* layer, int transform, bool* hit)
 {
-    if (target == NULL || rect.isEmpty()) {
+    Memory* handle = layer->handle;
+    *hit = false;
+    mRotBuffer = NULL;
+    mRotLeft = mRotTop = 0;
+
+    if (mTarget == NULL) return 0;
+
+    int index = -1;
+    for (int i = 0; i < ROT_CACHE_SIZE; i++) {
+        RotCacheEntry& entry = mRotCache[i];
+        if (entry.source == handle && entry.phys == (uint64_t)handle->phys) {
+            index = i;
+            break;
+        }
+    }
+
+    bool continuous = false;
+    if (index < 0) {
+        // first time seen, take the free or least recently used slot.
+        index = 0;
+        for (int i = 0; i < ROT_CACHE_SIZE; i++) {
+            if (mRotCache[i].source == NULL) {
+                index = i;
+                break;
+            }
+            if (mRotCache[i].lastFrame < mRotCache[index].lastFrame) {
+                index = i;
+            }
+        }
+        releaseRotCache(index);
+    }
+    else {
+        continuous = (mFrameCount - mRotCache[index].lastFrame) <= 1;
+    }
+
+    RotCacheEntry& entry = mRotCache[index];
+    bool same = entry.transform == layer->transform &&
+                entry.alpha == layer->planeAlpha &&
+                entry.crop == layer->sourceCrop;
+
+    entry.source = handle;
+    entry.phys = (uint64_t)handle->phys;
+    entry.transform = layer->transform;
+    entry.alpha = layer->planeAlpha;
+    entry.crop = layer->sourceCrop;
+    entry.lastFrame = mFrameCount;
+
+    if (!continuous) {
+        // the buffer was off screen, its content may have changed since.
+        // the caller rotates into scratch without caching.
+        releaseRotCache(index);
         return 0;
     }
 
-    struct g2d_surfaceEx surfaceX;
-    memset(&surfaceX, 0, sizeof(surfaceX));
-    struct g2d_surface& surface = surfaceX.base;
-    ALOGV("clearRect: rect(l:%d,t:%d,r:%d,b:%d)",
-            rect.left, rect.top, rect.right, rect.bottom);
-    setG2dSurface(surfaceX, target, rect);
-    surface.clrcolor = 0xff << 24;
-    clearFunction(mHandle, &surface);
+    if (same && entry.filled) {
+        RotEntry& rot = mRotPool[entry.atlas ? mAtlasPool : entry.pool];
+        rot.lastUsed = mFrameCount;
+        mRotBuffer = rot.memory;
+        mRotLeft = entry.rect.left;
+        mRotTop = entry.rect.top;
+        *hit = true;
+        return 0;
+    }
+
+    // the buffer stayed on screen, keep its rotated content for the
+    // following frames. the caller fills it by the rotation pass.
+    if (!same) {
+        releaseRotCache(index);
+    }
+
+    if (entry.pool < 0 && !entry.atlas) {
+        Rect& crop = layer->sourceCrop;
+        int width = transform ? crop.height() : crop.width();
+        int height = transform ? crop.width() : crop.height();
+        if (allocAtlasRect(width, height, &entry.rect) == 0) {
+            entry.atlas = true;
+        }
+        else {
+            int pool = acquireRotBuffer(width, height, true);
+            if (pool < 0) {
+                return 0;
+            }
+            entry.pool = pool;
+            entry.rect = Rect(width, height);
+        }
+    }
 
+    entry.filled = true;
+    RotEntry& rot = mRotPool[entry.atlas ? mAtlasPool : entry.pool];
+    rot.lastUsed = mFrameCount;
+    mRotBuffer = rot.memory;
+    mRotLeft = entry.rect.left;
+    mRotTop = entry.rect.top;
     return 0;
 }
 
-int Composer::clearWormHole(LayerVector& layers)
+int Composer::allocAtlasRect(int width, int height, Rect* rect)
 {
-    if (mTarget == NULL) {
-        ALOGE("clearWormHole: no effective render buffer");
-        return -EINVAL;
+    if (mAtlasPool < 0) {
+        // large enough for a full screen layer and a few bars in both
+        // orientations.
+        int size = (mTarget->width > mTarget->height) ?
+                    mTarget->width : mTarget->height;
+        mAtlasPool = acquireRotBuffer(size, size, true);
+        if (mAtlasPool < 0) {
+            mAtlasPool = -1;
+            return -ENOMEM;
+        }
+        mAtlasShelves.clear();
+        mAtlasBottom = 0;
+        mAtlasUsers = 0;
     }
 
-    // calculate opaque region.
-    Region opaque;
-    size_t count = layers.size();
-    for (size_t i=0; i<count; i++) {
-        Layer* layer = layers[i];
-        if (!layer->busy){
-            ALOGE("clearWormHole: compose invalid layer");
+    // rotation output must start on a block boundary.
+    RotEntry& atlas = mRotPool[mAtlasPool];
+    width = ALIGN_PIXEL(width, ROT_BLOCK_SIZE);
+    height = ALIGN_PIXEL(height, ROT_BLOCK_SIZE);
+
+    // the lowest shelf with room, new shelf below the others otherwise.
+    int index = -1;
+    for (size_t i=0; i<mAtlasShelves.size(); i++) {
+        const RotShelf& shelf = mAtlasShelves[i];
+        if (shelf.height < height || shelf.used + width > atlas.width) {
             continue;
         }
-
-        if ((layer->blendMode == BLENDING_NONE) ||
-             (i==0 && layer->blendMode == BLENDING_PREMULT) ||
-             ((i!=0) && (layer->blendMode == BLENDING_DIM) &&
-              ((layer->color >> 24)&0xff) == 0xff)) {
-            opaque.orSelf(layer->visibleRegion);
+        if (index < 0 || shelf.height < mAtlasShelves[index].height) {
+            index = i;
         }
     }
 
-    // calculate worm hole.
-    Region screen(Rect(mTarget->width, mTarget->height));
-    screen.subtractSelf(opaque);
-    const Rect *holes = NULL;
-    size_t numRect = 0;
-    holes = screen.getArray(&numRect);
-    // clear worm hole.
-    struct g2d_surfaceEx surfaceX;
-    memset(&surfaceX, 0, sizeof(surfaceX));
-    struct g2d_surface& surface = surfaceX.base;
-    for (size_t i=0; i<numRect; i++) {
-        if (holes[i].isEmpty()) {
-            continue;
+    if (index < 0) {
+        if (mAtlasBottom + height > atlas.height || width > atlas.width) {
+            return -ENOMEM;
         }
-
-        Rect& rect = (Rect&)holes[i];
-        ALOGV("clearhole: hole(l:%d,t:%d,r:%d,b:%d)",
-                rect.left, rect.top, rect.right, rect.bottom);
-        setG2dSurface(surfaceX, mTarget, rect);
-        surface.clrcolor = 0xff << 24;
-        clearFunction(mHandle, &surface);
+        RotShelf shelf;
+        shelf.top = mAtlasBottom;
+        shelf.height = height;
+        shelf.used = 0;
+        mAtlasShelves.add(shelf);
+        mAtlasBottom += height;
+        index = mAtlasShelves.size() - 1;
     }
 
+    RotShelf& shelf = mAtlasShelves.editItemAt(index);
+    *rect = Rect(shelf.used, shelf.top, shelf.used + width, shelf.top + height);
+    shelf.used += width;
+    mAtlasUsers++;
     return 0;
 }
 
-int Composer::composeLayer(Layer* layer, bool bypass)
+void Composer::releaseAtlasRect()
 {
-    if (layer == NULL || mTarget == NULL) {
-        ALOGE("composeLayer: invalid layer or target");
-        return -EINVAL;
+    if (mAtlasPool < 0 || --mAtlasUsers > 0) {
+        return;
     }
 
-    if (bypass && layer->isSolidColor()) {
-        ALOGV("composeLayer dim layer bypassed");
-        return 0;
-    }
+    // shelves are not compacted, the atlas is reset once it is unused.
+    mRotPool[mAtlasPool].pinned = false;
+    mRotPool[mAtlasPool].lastUsed = mFrameCount;
+    mAtlasPool = -1;
+    mAtlasShelves.clear();
+    mAtlasBottom = 0;
+}
 
-    Rect srect = layer->sourceCrop;
-    Rect drect = layer->displayFrame;
-    Rect rrect;
+void Composer::releaseRotCache(int index)
+{
+    RotCacheEntry& entry = mRotCache[index];
+    if (entry.atlas) {
+        releaseAtlasRect();
+    }
+    else if (entry.pool >= 0) {
+        mRotPool[entry.pool].pinned = false;
+        mRotPool[entry.pool].lastUsed = mFrameCount;
+    }
 
-    struct g2d_surfaceEx dSurfaceX;
-    struct g2d_surface& dSurface = dSurfaceX.base;
+    entry.pool = -1;
+    entry.atlas = false;
+    entry.filled = false;
+}
 
-    if ((srect.isEmpty() && !layer->isSolidColor()) || drect.isEmpty()) {
-        ALOGE("composeLayer: invalid srect or drect");
-        return 0;
+void Composer::touchRotCache(Layer* layer)
+{
+    if (layer->handle == NULL) {
+        return;
     }
 
-    if (layer->isSolidColor()) {
-        checkDimBuffer();
+    // keep cache entries of layers which are not recomposed this frame.
+    for (int i = 0; i < ROT_CACHE_SIZE; i++) {
+        RotCacheEntry& entry = mRotCache[i];
+        if (entry.source == layer->handle &&
+            entry.phys == (uint64_t)layer->handle->phys &&
+            mFrameCount - entry.lastFrame <= 1) {
+            entry.lastFrame = mFrameCount;
+            break;
+        }
     }
+}
 
-//    if (mRotBuffers[0] == NULL)
-//	allocRotBuffer(1920/*1080*/,1920, 0);
-	
-    size_t count = 0;
-    const Rect* visible = layer->visibleRegion.getArray(&count);
-    for (size_t i=0; i<count; i++) {
-        Rect srect = layer->sourceCrop;
+static bool isSameRegion(const Region& a, const Region& b)
+{
+    return a.subtract(b).isEmpty() && b.subtract(a).isEmpty();
+}
 
-        Rect clip = visible[i];
-        if (clip.isEmpty()) {
-            ALOGV("composeLayer: invalid clip");
-            continue;
+void Composer::invalidateDamage()
+{
+    mLayerStates.clear();
+    mDamageValid = false;
+    memset(&mTargetAges[0], 0, sizeof(mTargetAges));
+    mHoleValid = false;
+    resetHoleState(NULL);
+
+    // mFrameCount only advances on 2D frames, so the rotated content
+    // age can't tell frames composed elsewhere in between.
+    for (int i = 0; i < ROT_CACHE_SIZE; i++) {
+        if (mRotCache[i].source != NULL) {
+            releaseRotCache(i);
+            mRotCache[i].source = NULL;
         }
+    }
+}
 
-        clip.intersect(drect, &clip);
-        if (clip.isEmpty()) {
-            ALOGV("composeLayer: invalid clip rect");
-            continue;
-        }
+bool Composer::isSameLayerState(const LayerState& state, Layer* layer)
+{
+    return state.handle == layer->handle &&
+           state.transform == layer->transform &&
+           state.blendMode == layer->blendMode &&
+           state.planeAlpha == layer->planeAlpha &&
+           state.color == (uint32_t)layer->color &&
+           state.sourceCrop == layer->sourceCrop &&
+           state.displayFrame == layer->displayFrame &&
+           isSameRegion(state.visibleRegion, layer->visibleRegion);
+}
 
-        setClipping(srect, drect, clip, layer->transform);
-/*
-        ALOGE("index:%d, i:%d sourceCrop(l:%d,t:%d,r:%d,b:%d), "
-             "visible(l:%d,t:%d,r:%d,b:%d), "
-             "display(l:%d,t:%d,r:%d,b:%d)", layer->index, (int)i,
-             srect.left, srect.top, srect.right, srect.bottom,
-             clip.left, clip.top, clip.right, clip.bottom,
-             drect.left, drect.top, drect.right, drect.bottom);
-        ALOGE("target phys:0x%x, layer phys:0x%x",
-                (int)mTarget->phys, (int)layer->handle->phys);
-        ALOGE("transform:0x%x, blend:0x%x, alpha:0x%x solid:%d",
-                layer->transform, layer->blendMode, layer->planeAlpha, layer->isSolidColor() ? 1:0);
-*/
-        struct g2d_surfaceEx sSurfaceX;
+bool Composer::hasSkippedLayers()
+{
+    return mLayerSkipped;
+}
+
+bool Composer::isLayerStackUnchanged(LayerVector& layers, Memory* target)
+{
+    if (!mDamageValid || target == NULL || target != mTarget) {
+        return false;
+    }
+
+    size_t count = layers.size();
+    if (count != mLayerStates.size()) {
+        return false;
+    }
+
+    for (size_t i=0; i<count; i++) {
+        if (!isSameLayerState(mLayerStates[i], layers[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * A gralloc buffer only gets new content after it was dequeued by its
+ * producer, so a layer showing the same buffer with the same geometry
+ * as last frame is unchanged. Damage of each frame is kept for a few
+ * frames so that every target is repaired in the union of the damage
+ * since it was composed last time.
+ */
+void Composer::calcDamage(LayerVector& layers)
+{
+    Rect screen(mTarget->width, mTarget->height);
+    Region damage;
+
+    size_t count = layers.size();
+    size_t prev = mLayerStates.size();
+    size_t num = (count > prev) ? count : prev;
+    bool geometry = false;
+    for (size_t i=0; i<num; i++) {
+        if (i >= count) {
+            damage.orSelf(mLayerStates[i].visibleRegion);
+            continue;
+        }
+
+        Layer* layer = layers[i];
+        if (i >= prev) {
+            damage.orSelf(layer->visibleRegion);
+            continue;
+        }
+
+        const LayerState& state = mLayerStates[i];
+        if (!isSameLayerState(state, layer)) {
+            damage.orSelf(state.visibleRegion);
+            damage.orSelf(layer->visibleRegion);
+        }
+
+        if (!(state.displayFrame == layer->displayFrame) ||
+            state.blendMode != layer->blendMode ||
+            state.color != (uint32_t)layer->color ||
+            !isSameRegion(state.visibleRegion, layer->visibleRegion)) {
+            geometry = true;
+        }
+    }
+    mGeometryChanged = geometry || count != prev || !mDamageValid;
+
+    if (!mDamageValid) {
+        damage.set(screen);
+    }
+    mDamage[mFrameCount % DAMAGE_HISTORY] = damage;
+
+    mLayerStates.clear();
+    for (size_t i=0; i<count; i++) {
+        Layer* layer = layers[i];
+        LayerState state;
+        state.handle = layer->handle;
+        state.transform = layer->transform;
+        state.blendMode = layer->blendMode;
+        state.planeAlpha = layer->planeAlpha;
+        state.color = layer->color;
+        state.sourceCrop = layer->sourceCrop;
+        state.displayFrame = layer->displayFrame;
+        state.visibleRegion = layer->visibleRegion;
+        mLayerStates.add(state);
+    }
+    mDamageValid = true;
+    mRepair = widenRepair(layers, getRepair(mTarget, screen));
+}
+
+/*
+ * Source edges of a scaled layer are rounded per clip rect, so a repair
+ * boundary across it leaves a seam against the pixels kept from earlier
+ * frames. Scaled layers touched by repair are recomposed as a whole.
+ */
+Region Composer::widenRepair(LayerVector& layers, const Region& repair)
+{
+    Region widened(repair);
+    size_t count = layers.size();
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i=0; i<count; i++) {
+            Layer* layer = layers[i];
+            if (!isScaledLayer(layer) ||
+                widened.intersect(layer->visibleRegion).isEmpty() ||
+                layer->visibleRegion.subtract(widened).isEmpty()) {
+                continue;
+            }
+            widened.orSelf(layer->visibleRegion);
+            changed = true;
+        }
+    }
+
+    return widened;
+}
+
+bool Composer::isScaledLayer(Layer* layer)
+{
+    if (layer->isSolidColor() || layer->handle == NULL) {
+        return false;
+    }
+
+    Rect srect = layer->sourceCrop;
+    Rect drect = layer->displayFrame;
+    int width = srect.width();
+    int height = srect.height();
+    if (layer->transform & TRANSFORM_ROT90) {
+        width = srect.height();
+        height = srect.width();
+    }
+
+    return width != drect.width() || height != drect.height();
+}
+
+Composer::HoleState& Composer::getHoleState(Memory* target)
+{
+    int index = 0;
+    for (int i = 0; i < TARGET_AGE_SIZE; i++) {
+        if (mHoleStates[i].target == target) {
+            index = i;
+            break;
+        }
+        if (mHoleStates[i].frame < mHoleStates[index].frame) {
+            index = i;
+        }
+    }
+
+    HoleState& state = mHoleStates[index];
+    if (state.target != target) {
+        state.target = target;
+        state.black.clear();
+    }
+    state.frame = mFrameCount;
+    return state;
+}
+
+void Composer::resetHoleState(Memory* target)
+{
+    for (int i = 0; i < TARGET_AGE_SIZE; i++) {
+        if (target == NULL || mHoleStates[i].target == target) {
+            mHoleStates[i].target = NULL;
+            mHoleStates[i].black.clear();
+        }
+    }
+}
+
+Region Composer::getRepair(Memory* target, const Rect& screen)
+{
+    // partial repair needs the 2D engine to clip each blit.
+    Region repair(screen);
+    if (mSetClipping == NULL) {
+        return repair;
+    }
+
+    for (int i = 0; i < TARGET_AGE_SIZE; i++) {
+        TargetAge& age = mTargetAges[i];
+        if (age.target != target) {
+            continue;
+        }
+
+        uint32_t frames = mFrameCount - age.frame;
+        if (frames == 0 || frames > DAMAGE_HISTORY) {
+            break;
+        }
+
+        Region damage;
+        for (uint32_t f = age.frame + 1; f != mFrameCount + 1; f++) {
+            damage.orSelf(mDamage[f % DAMAGE_HISTORY]);
+        }
+        repair = damage.intersect(screen);
+        break;
+    }
+
+    return repair;
+}
+
+void Composer::recordTargetAge(Memory* target)
+{
+    // remember when the target got its content, oldest slot is reused.
+    int index = 0;
+    for (int i = 0; i < TARGET_AGE_SIZE; i++) {
+        if (mTargetAges[i].target == target) {
+            index = i;
+            break;
+        }
+        if (mTargetAges[i].frame < mTargetAges[index].frame) {
+            index = i;
+        }
+    }
+    mTargetAges[index].target = target;
+    mTargetAges[index].frame = mFrameCount;
+}
+
+int Composer::getFrameTransform(LayerVector& layers)
+{
+    int transform = 0;
+    int rotated = 0;
+    size_t count = layers.size();
+    for (size_t i=0; i<count; i++) {
+        Layer* layer = layers[i];
+        if (layer->isSolidColor()) {
+            continue;
+        }
+
+        int t = layer->transform;
+        if (t != TRANSFORM_ROT90 && t != (TRANSFORM_FLIPH | TRANSFORM_FLIPV) &&
+            t != (TRANSFORM_FLIPH | TRANSFORM_FLIPV | TRANSFORM_ROT90)) {
+            return 0;
+        }
+
+        if (rotated > 0 && t != transform) {
+            return 0;
+        }
+        transform = t;
+        rotated++;
+    }
+
+    // a single layer is rotated as cheap in its own pass.
+    return (rotated > 1) ? transform : 0;
+}
+
+Rect Composer::mapToNative(const Rect& rect)
+{
+    // inverse of the frame rotation, from screen to native coordinates.
+    int width = mFrameScreen.width();
+    int height = mFrameScreen.height();
+    switch (mFrameTransform) {
+        case TRANSFORM_ROT90:
+            return Rect(rect.top, width - rect.right,
+                        rect.bottom, width - rect.left);
+        case TRANSFORM_FLIPH | TRANSFORM_FLIPV:
+            return Rect(width - rect.right, height - rect.bottom,
+                        width - rect.left, height - rect.top);
+        default:
+            return Rect(height - rect.bottom, rect.left,
+                        height - rect.top, rect.right);
+    }
+}
+
+Rect Composer::mapFromNative(const Rect& rect)
+{
+    // from native to screen coordinates, rects may reach past the screen.
+    int width = mFrameScreen.width();
+    int height = mFrameScreen.height();
+    switch (mFrameTransform) {
+        case TRANSFORM_ROT90:
+            return Rect(width - rect.bottom, rect.left,
+                        width - rect.top, rect.right);
+        case TRANSFORM_FLIPH | TRANSFORM_FLIPV:
+            return Rect(width - rect.right, height - rect.bottom,
+                        width - rect.left, height - rect.top);
+        default:
+            return Rect(rect.top, height - rect.right,
+                        rect.bottom, height - rect.left);
+    }
+}
+
+Region Composer::mapToNative(const Region& region)
+{
+    Region native;
+    size_t count = 0;
+    const Rect* rects = region.getArray(&count);
+    for (size_t i=0; i<count; i++) {
+        native.orSelf(mapToNative(rects[i]));
+    }
+
+    return native;
+}
+
+void Composer::beginFrameRotation(LayerVector& layers)
+{
+    int transform = getFrameTransform(layers);
+    if (transform == 0) {
+        if (mFramePool >= 0) {
+            mRotPool[mFramePool].pinned = false;
+            mFramePool = -1;
+        }
+        return;
+    }
+
+    int r = (transform & TRANSFORM_ROT90) ? 1 : 0;
+    int width = r ? mTarget->height : mTarget->width;
+    int height = r ? mTarget->width : mTarget->height;
+    if (mFramePool >= 0) {
+        RotEntry& entry = mRotPool[mFramePool];
+        if (entry.format != mTarget->fslFormat ||
+            width > entry.width || height > entry.height) {
+            entry.pinned = false;
+            mFramePool = -1;
+        }
+    }
+
+    if (mFramePool < 0) {
+        mFramePool = acquireRotBuffer(width, height, true);
+        if (mFramePool < 0) {
+            ALOGW("%s no native frame buffer, rotate layers", __func__);
+            mFramePool = -1;
+            return;
+        }
+        // content of a newly acquired buffer is unknown.
+        for (int i = 0; i < TARGET_AGE_SIZE; i++) {
+            if (mTargetAges[i].target == mRotPool[mFramePool].memory) {
+                mTargetAges[i].target = NULL;
+            }
+        }
+        resetHoleState(mRotPool[mFramePool].memory);
+    }
+    mRotPool[mFramePool].lastUsed = mFrameCount;
+
+    // compose layers unrotated into the native buffer.
+    mFrameTarget = mTarget;
+    mFrameTransform = transform;
+    mFrameScreen = Rect(mTarget->width, mTarget->height);
+    mFrameRepair = mRepair;
+    mTarget = mRotPool[mFramePool].memory;
+    mRepair = mapToNative(widenRepair(layers,
+                                      getRepair(mTarget, mFrameScreen)));
+
+    // layers keep their screen geometry, the composer works on copies.
+    mFrameLayers.clear();
+    size_t count = layers.size();
+    for (size_t i=0; i<count; i++) {
+        Layer* layer = layers[i];
+        FrameLayer frame;
+        frame.layer = layer;
+        frame.native = *layer;
+        frame.native.transform = 0;
+        frame.native.displayFrame = mapToNative(layer->displayFrame);
+        frame.native.visibleRegion = mapToNative(layer->visibleRegion);
+        mFrameLayers.add(frame);
+    }
+}
+
+Layer* Composer::getFrameLayer(Layer* layer)
+{
+    if (mFrameTarget == NULL) {
+        return layer;
+    }
+
+    size_t count = mFrameLayers.size();
+    for (size_t i=0; i<count; i++) {
+        if (mFrameLayers[i].layer == layer) {
+            return &mFrameLayers.editItemAt(i).native;
+        }
+    }
+
+    return layer;
+}
+
+void Composer::endFrameRotation()
+{
+    if (mFrameTarget == NULL) {
+        return;
+    }
+
+    mFrameLayers.clear();
+
+    // rotate the damaged part of framebuffer in one block aligned pass.
+    Memory* native = mTarget;
+    recordTargetAge(native);
+    mTarget = mFrameTarget;
+    mFrameTarget = NULL;
+    // framebuffer content comes from native buffer, holes are not known.
+    resetHoleState(mTarget);
+    if (mFrameRepair.isEmpty()) {
+        return;
+    }
+
+    Rect bounds = mFrameRepair.getBounds();
+    bounds.left &= ~(ROT_BLOCK_SIZE - 1);
+    bounds.top &= ~(ROT_BLOCK_SIZE - 1);
+    bounds.right = ALIGN_PIXEL(bounds.right, ROT_BLOCK_SIZE);
+    bounds.bottom = ALIGN_PIXEL(bounds.bottom, ROT_BLOCK_SIZE);
+    bounds.intersect(mFrameScreen, &bounds);
+
+    // screen edges not on a block boundary are rotated in two passes.
+    Rect aligned(0, 0);
+    if ((mTarget->stride % ROT_BLOCK_SIZE) == 0) {
+        Rect blocks(mFrameScreen.width() & ~(ROT_BLOCK_SIZE - 1),
+                    mFrameScreen.height() & ~(ROT_BLOCK_SIZE - 1));
+        bounds.intersect(blocks, &aligned);
+    }
+
+    clearClipping();
+    enableFunction(mHandle, G2D_BLEND, false);
+    enableFunction(mHandle, G2D_GLOBAL_ALPHA, false);
+    if (!aligned.isEmpty()) {
+        Rect nrect = mapToNative(aligned);
+        struct g2d_surfaceEx sSurfaceX, dSurfaceX;
         memset(&sSurfaceX, 0, sizeof(sSurfaceX));
-        struct g2d_surface& sSurface = sSurfaceX.base;
+        memset(&dSurfaceX, 0, sizeof(dSurfaceX));
+        setG2dSurface(sSurfaceX, native, nrect);
+        setG2dSurface(dSurfaceX, mTarget, aligned);
+        convertRotation(mFrameTransform, sSurfaceX.base, dSurfaceX.base);
+        blitSurface(&sSurfaceX, &dSurfaceX);
+    }
+
+    Region tail = Region(bounds).subtract(aligned);
+    size_t count = 0;
+    const Rect* rects = tail.getArray(&count);
+    for (size_t i=0; i<count; i++) {
+        rotateFrameEdge(native, rects[i]);
+    }
+}
+
+int Composer::rotateFrameEdge(Memory* native, const Rect& rect)
+{
+    // grow the source to whole blocks, native buffers are allocated
+    // block aligned so the extra pixels are still inside the buffer.
+    Rect nrect = mapToNative(rect);
+    nrect.right = nrect.left + ALIGN_PIXEL(nrect.width(), ROT_BLOCK_SIZE);
+    nrect.bottom = nrect.top + ALIGN_PIXEL(nrect.height(), ROT_BLOCK_SIZE);
+    if (nrect.right > native->width || nrect.bottom > native->height) {
+        ALOGE("%s native buffer too small", __func__);
+        return -EINVAL;
+    }
+
+    int r = (mFrameTransform & TRANSFORM_ROT90) ? 1 : 0;
+    allocRotBuffer(nrect.width(), nrect.height(), r);
+    if (mRotBuffer == NULL) {
+        ALOGE("%s no rotation buffer", __func__);
+        return -ENOMEM;
+    }
+
+    // rotate into scratch at block aligned origin, then copy the part
+    // on screen unrotated.
+    Rect grown = mapFromNative(nrect);
+    Rect rrect(grown.width(), grown.height());
+    struct g2d_surfaceEx sSurfaceX, rSurfaceX, dSurfaceX;
+    memset(&sSurfaceX, 0, sizeof(sSurfaceX));
+    memset(&rSurfaceX, 0, sizeof(rSurfaceX));
+    memset(&dSurfaceX, 0, sizeof(dSurfaceX));
+    setG2dSurface(sSurfaceX, native, nrect);
+    setG2dSurface(rSurfaceX, mRotBuffer, rrect);
+    convertRotation(mFrameTransform, sSurfaceX.base, rSurfaceX.base);
+    blitSurface(&sSurfaceX, &rSurfaceX);
+
+    Rect part(rect.left - grown.left, rect.top - grown.top,
+              rect.right - grown.left, rect.bottom - grown.top);
+    Rect drect = rect;
+    memset(&rSurfaceX, 0, sizeof(rSurfaceX));
+    setG2dSurface(rSurfaceX, mRotBuffer, part);
+    setG2dSurface(dSurfaceX, mTarget, drect);
+    blitSurface(&rSurfaceX, &dSurfaceX);
+
+    mRotBuffer = NULL;
+    return 0;
+}
+
+int Composer::finishComposite()
+{
+    flushFusedBottom();
+    endFrameRotation();
+    // the worker exists whenever an engine is open.
+    if (mWorker != NULL) {
+        // hand the frame to the worker, wait only if the ring is full.
+        uint32_t head = mQueueHead.load(std::memory_order_relaxed);
+        waitFrames(head + 1 - FRAME_QUEUE_SIZE);
+
+        Frame& frame = mFrames[head % FRAME_QUEUE_SIZE];
+        frame.commands = mCommands;
+        frame.targetPlane = (mTarget != NULL) ? getPlaneAddress(mTarget) : 0;
+        mQueueHead.store(head + 1, std::memory_order_release);
+        mWorker->signal();
+    }
+    mCommands.clear();
+
+    if (mTarget != NULL) {
+        recordTargetAge(mTarget);
+    }
+
+    // buffers not referenced by the committed frame can be released.
+    mFrameCount++;
+    for (int i = 0; i < ROT_CACHE_SIZE; i++) {
+        if (mRotCache[i].source != NULL &&
+            mFrameCount - mRotCache[i].lastFrame > 1) {
+            releaseRotCache(i);
+            mRotCache[i].source = NULL;
+        }
+    }
+    if (mArenaPool >= 0 &&
+        mFrameCount - mRotPool[mArenaPool].lastUsed >= ROT_POOL_IDLE_FRAMES) {
+        mRotPool[mArenaPool].pinned = false;
+        mArenaPool = -1;
+    }
+    evictRotBuffers(ROT_POOL_IDLE_FRAMES, mRotPoolBytes);
+    mRotBuffer = NULL;
+
+    return 0;
+}
+
+int Composer::waitComposite()
+{
+    if (mWorker == NULL) {
+        return 0;
+    }
+
+    waitFrames(mQueueHead.load(std::memory_order_relaxed));
+    return 0;
+}
+
+void Composer::waitFrameDone(uint32_t frame)
+{
+    if (mWorker == NULL) {
+        return;
+    }
+
+    // frames are queued in mFrameCount order.
+    waitFrames(frame + 1);
+}
+
+void Composer::waitFrames(uint32_t seq)
+{
+    if ((int32_t)(mQueueTail.load(std::memory_order_acquire) - seq) >= 0) {
+        return;
+    }
+
+    Mutex::Autolock _l(mDoneLock);
+    while ((int32_t)(mQueueTail.load(std::memory_order_acquire) - seq) < 0) {
+        mDoneCond.wait(mDoneLock);
+    }
+}
+
+bool Composer::hasQueuedFrame()
+{
+    return mQueueTail.load(std::memory_order_relaxed) !=
+           mQueueHead.load(std::memory_order_acquire);
+}
+
+void Composer::runQueuedFrame()
+{
+    uint32_t tail = mQueueTail.load(std::memory_order_relaxed);
+    Frame& frame = mFrames[tail % FRAME_QUEUE_SIZE];
+    // CPU composite holds the gralloc locks for the whole frame.
+    Vector<Memory*> buffers;
+    if (mSoftware) {
+        lockFrameBuffers(frame.commands, buffers);
+    }
+
+    Vector<CpuBlit> cpuBlits;
+    submitCommands(frame.commands, frame.targetPlane, cpuBlits);
+    finishFrame();
+    // tiny blits left to CPU run once the engine is done with the target.
+    runCpuBlits(frame.commands, cpuBlits);
+    frame.commands.clear();
+    if (mSoftware) {
+        unlockCpuBuffers(buffers);
+    }
+
+    mQueueTail.store(tail + 1, std::memory_order_release);
+    Mutex::Autolock _l(mDoneLock);
+    mDoneCond.broadcast();
+}
+
+int Composer::setRenderTarget(Memory* memory)
+{
+    mTarget = memory;
+    mFuseBottom = NULL;
+    mLayerSkipped = false;
+    if (mTarget != NULL && !isCpuMapped(mTarget)) {
+        mTarget = NULL;
+        return -EINVAL;
+    }
+    if (mTarget != NULL) {
+        mRepair.set(Rect(mTarget->width, mTarget->height));
+    }
+    return 0;
+}
+
+int Composer::clearRect(Memory* target, Rect& rect)
+{
+    return fillRect(target, rect, 0xff << 24);
+}
+
+int Composer::fillRect(Memory* target, Rect& rect, uint32_t color)
+{
+    if (target == NULL || rect.isEmpty()) {
+        return 0;
+    }
+
+    struct g2d_surfaceEx surfaceX;
+    memset(&surfaceX, 0, sizeof(surfaceX));
+    struct g2d_surface& surface = surfaceX.base;
+    ALOGV("fillRect: rect(l:%d,t:%d,r:%d,b:%d) color:0x%x",
+            rect.left, rect.top, rect.right, rect.bottom, color);
+    setG2dSurface(surfaceX, target, rect);
+    surface.clrcolor = color;
+    clearFunction(mHandle, &surface);
+
+    return 0;
+}
+
+int Composer::clearWormHole(LayerVector& layers)
+{
+    if (mTarget == NULL) {
+        ALOGE("clearWormHole: no effective render buffer");
+        return -EINVAL;
+    }
+
+    calcDamage(layers);
+    beginFrameRotation(layers);
+
+    size_t count = layers.size();
+    for (size_t i=0; i<count; i++) {
+        touchRotCache(layers[i]);
+    }
+
+    // worm hole only changes with layer geometry.
+    int mode = (mFrameTarget != NULL) ? mFrameTransform : 0;
+    Rect bounds(mTarget->width, mTarget->height);
+    if (mGeometryChanged || !mHoleValid || mode != mHoleMode ||
+        !(bounds == mHoleBounds)) {
+        // calculate opaque region.
+        Region opaque;
+        Region covered;
+        for (size_t i=0; i<count; i++) {
+            Layer* layer = getFrameLayer(layers[i]);
+            if (!layer->busy){
+                ALOGE("clearWormHole: compose invalid layer");
+                continue;
+            }
+
+            covered.orSelf(layer->visibleRegion);
+            if ((layer->blendMode == BLENDING_NONE) ||
+                 (i==0 && layer->blendMode == BLENDING_PREMULT) ||
+                 ((i!=0) && (layer->blendMode == BLENDING_DIM) &&
+                  ((layer->color >> 24)&0xff) == 0xff)) {
+                opaque.orSelf(layer->visibleRegion);
+            }
+        }
+
+        // calculate worm hole.
+        Region screen(bounds);
+        mHoles = screen.subtract(opaque);
+        mBareHoles = screen.subtract(covered);
+        mHoleMode = mode;
+        mHoleBounds = bounds;
+        mHoleValid = true;
+    }
+
+    // holes still black in this target since last cleared are skipped.
+    HoleState& state = getHoleState(mTarget);
+    Region hole = mHoles.intersect(mRepair);
+    Region clear = hole.subtract(state.black);
+    state.black.orSelf(hole);
+    state.black.andSelf(mBareHoles);
+
+    const Rect *holes = NULL;
+    size_t numRect = 0;
+    holes = clear.getArray(&numRect);
+    // clear worm hole.
+    struct g2d_surfaceEx surfaceX;
+    memset(&surfaceX, 0, sizeof(surfaceX));
+    struct g2d_surface& surface = surfaceX.base;
+    for (size_t i=0; i<numRect; i++) {
+        if (holes[i].isEmpty()) {
+            continue;
+        }
+
+        Rect& rect = (Rect&)holes[i];
+        ALOGV("clearhole: hole(l:%d,t:%d,r:%d,b:%d)",
+                rect.left, rect.top, rect.right, rect.bottom);
+        setG2dSurface(surfaceX, mTarget, rect);
+        surface.clrcolor = 0xff << 24;
+        clearFunction(mHandle, &surface);
+    }
+
+    return 0;
+}
+
+int Composer::composeLayer(Layer* layer, bool bypass)
+{
+    if (layer == NULL || mTarget == NULL) {
+        ALOGE("composeLayer: invalid layer or target");
+        return -EINVAL;
+    }
+    layer = getFrameLayer(layer);
+
+    if (bypass && layer->isSolidColor()) {
+        ALOGV("composeLayer dim layer bypassed");
+        return 0;
+    }
+
+    Rect srect = layer->sourceCrop;
+    Rect drect = layer->displayFrame;
+
+    if ((srect.isEmpty() && !layer->isSolidColor()) || drect.isEmpty()) {
+        ALOGE("composeLayer: invalid srect or drect");
+        return 0;
+    }
+
+    if (!isLayerReadable(layer)) {
+        ALOGW("composeLayer: buffer can't be read by blit engine");
+        mLayerSkipped = true;
+        return -EINVAL;
+    }
+
+    // only recompose the part of layer in repair region.
+    Region region = layer->visibleRegion.intersect(mRepair);
+    if (region.isEmpty()) {
+        ALOGV("composeLayer: layer not damaged");
+        return 0;
+    }
+
+    // hold the bottom layer back to blend it with the next layer in one pass.
+    if (bypass && isFusableBottom(layer)) {
+        flushFusedBottom();
+        mFuseBottom = layer;
+        return 0;
+    }
+
+    if (mFuseBottom != NULL) {
+        Layer* bottom = mFuseBottom;
+        mFuseBottom = NULL;
+        if (isFusableTop(bottom, layer)) {
+            return composeFused(bottom, layer, region);
+        }
+
+        Region below = bottom->visibleRegion.intersect(mRepair);
+        composeRegion(bottom, below, true);
+    }
+
+    return composeRegion(layer, region, bypass);
+}
+
+int Composer::composeRegion(Layer* layer, Region& region, bool bypass)
+{
+    Rect drect = layer->displayFrame;
+    Rect rrect;
+
+    struct g2d_surfaceEx dSurfaceX;
+    struct g2d_surface& dSurface = dSurfaceX.base;
+
+    // translucent solid color is blended from the dim buffer filled with
+    // the opaque color, color alpha is folded into plane alpha.
+    Layer solid;
+    if (layer->isSolidColor()) {
+        uint32_t alpha = ((uint32_t)layer->color >> 24) & 0xff;
+        if (alpha == 0xff && layer->planeAlpha == 0xff) {
+            return fillSolidLayer(layer, region);
+        }
+        checkDimBuffer();
+        setDimColor(layer->color | 0xff000000);
+        solid = *layer;
+        solid.planeAlpha = mulDiv255(layer->planeAlpha, alpha);
+        layer = &solid;
+    }
+
+    // the rotation pass into a cached buffer does not depend on the clip
+    // rect, so it is done once per layer or skipped when already filled.
+    bool rotated = false;
+    bool checked = false;
+    bool scaleFirst = false;
+    size_t count = 0;
+    const Rect* visible = region.getArray(&count);
+    for (size_t i=0; i<count; i++) {
+        Rect srect = layer->sourceCrop;
+
+        Rect clip = visible[i];
+        if (clip.isEmpty()) {
+            ALOGV("composeLayer: invalid clip");
+            continue;
+        }
+
+        clip.intersect(drect, &clip);
+        if (clip.isEmpty()) {
+            ALOGV("composeLayer: invalid clip rect");
+            continue;
+        }
+
+        setClipping(srect, drect, clip, layer->transform);
+/*
+        ALOGE("index:%d, i:%d sourceCrop(l:%d,t:%d,r:%d,b:%d), "
+             "visible(l:%d,t:%d,r:%d,b:%d), "
+             "display(l:%d,t:%d,r:%d,b:%d)", layer->index, (int)i,
+             srect.left, srect.top, srect.right, srect.bottom,
+             clip.left, clip.top, clip.right, clip.bottom,
+             drect.left, drect.top, drect.right, drect.bottom);
+        ALOGE("target phys:0x%x, layer phys:0x%x",
+                (int)mTarget->phys, (int)layer->handle->phys);
+        ALOGE("transform:0x%x, blend:0x%x, alpha:0x%x solid:%d",
+                layer->transform, layer->blendMode, layer->planeAlpha, layer->isSolidColor() ? 1:0);
+*/
+        struct g2d_surfaceEx sSurfaceX;
+        memset(&sSurfaceX, 0, sizeof(sSurfaceX));
+        struct g2d_surface& sSurface = sSurfaceX.base;
+
+        if (!layer->isSolidColor()) {
+	    if (layer->handle == NULL) continue;
+            setG2dSurface(sSurfaceX, layer->handle, srect);
+	} else {
+	    if (mDimBuffer == NULL) continue;
+            Rect dim(DIM_BUFFER_SIZE, DIM_BUFFER_SIZE);
+            setG2dSurface(sSurfaceX, mDimBuffer, dim);
+	}
+
+	memset(&dSurfaceX, 0, sizeof(dSurfaceX));
+        setG2dSurface(dSurfaceX, mTarget, drect);
+
+        convertRotation(layer->transform, sSurface, dSurface);
+
+//workaround for "e8151: PXP: Rotation Engine alignment and operation combination limitations"
+	if (dSurface.rot != G2D_ROTATION_0) { //90 180 270
+
+		struct g2d_surfaceEx rSurfaceX;
+		memset(&rSurfaceX, 0, sizeof(rSurfaceX));
+    		struct g2d_surface& rSurface = rSurfaceX.base;
+
+		if (isRotationSafe(layer, sSurface, dSurface, clip, bypass)) {
+			// opaque and block aligned, rotate into target directly.
+			blitSurface(&sSurfaceX, &dSurfaceX);
+			continue;
+		}
+
+		int r = ((dSurface.rot == G2D_ROTATION_90) || (dSurface.rot == G2D_ROTATION_270)) ? 1 : 0;
+
+		if (!checked) {
+			checkRotCache(layer, r, &rotated);
+			checked = true;
+			scaleFirst = mRotBuffer == NULL &&
+			             sSurface.rot == G2D_ROTATION_0 &&
+			             isScaleFirst(sSurface, dSurface) &&
+			             getArenaRows(drect.width()) >= drect.height();
+		}
+
+		if (scaleFirst) {
+			// downscaled, rotate at target size in the first pass.
+			scaleRotateClip(layer, sSurfaceX, dSurfaceX, clip, bypass, &rotated);
+			continue;
+		}
+
+		if (mRotBuffer == NULL && sSurface.rot == G2D_ROTATION_0 &&
+		    isSameSize(sSurface, dSurface)) {
+			// not cached, rotate only the source area of the clip rect.
+			rotateClip(layer, sSurfaceX, dSurfaceX, clip, bypass);
+			continue;
+		}
+
+		if (mRotBuffer == NULL && !rotated) {
+			allocRotBuffer(layer->handle->width, layer->handle->height, r);
+		}
+
+		if (mRotBuffer == NULL) {
+		        ALOGE("rotBuffer == NULL !");
+			continue;
+		}
+
+		// rotated crop is placed at the origin given with the buffer.
+		rrect.left   = mRotLeft;
+		rrect.top    = mRotTop;
+		if (r) {
+			rrect.right  = mRotLeft + sSurface.bottom - sSurface.top;
+			rrect.bottom = mRotTop + sSurface.right - sSurface.left;
+		} else {
+			rrect.right  = mRotLeft + sSurface.right - sSurface.left;
+			rrect.bottom = mRotTop + sSurface.bottom - sSurface.top;
+		}
+
+	        setG2dSurface(rSurfaceX, mRotBuffer, rrect);
+	        rSurface.rot = dSurface.rot;
+		dSurface.rot = sSurface.rot;
+		sSurface.rot = G2D_ROTATION_0; //discard flip
+
+		if (!rotated) {
+			// clip rect is in target coordinates.
+			clearClipping();
+			enableFunction(mHandle, G2D_BLEND, true);
+			enableFunction(mHandle, G2D_GLOBAL_ALPHA, true);
+		        sSurface.global_alpha = layer->planeAlpha;
+			sSurface.blendfunc = G2D_ONE; //enable alpha
+			rSurface.blendfunc = G2D_ZERO;
+		        blitSurface(&sSurfaceX, &rSurfaceX); // just rotate please
+			rotated = true;
+			setClipping(srect, drect, clip, layer->transform);
+		}
+		rSurface.rot = G2D_ROTATION_0;
+
+		bool blend = (layer->blendMode != BLENDING_NONE && !bypass);
+		enableFunction(mHandle, G2D_BLEND, blend);
+		enableFunction(mHandle, G2D_GLOBAL_ALPHA, blend);
+
+		if (!bypass)
+			convertBlending(layer->blendMode, rSurface, dSurface);
+
+	        rSurface.global_alpha = layer->planeAlpha;
+
+		blitSurface(&rSurfaceX, &dSurfaceX);
+
+	        if (blend) {
+			enableFunction(mHandle, G2D_BLEND, false);
+			enableFunction(mHandle, G2D_GLOBAL_ALPHA, false);
+		}
+
+		continue;
+	}
+
+	if (!bypass)
+	       	convertBlending(layer->blendMode, sSurface, dSurface);
+	sSurface.global_alpha = layer->planeAlpha;
+
+	if (layer->blendMode != BLENDING_NONE && !bypass) {
+		enableFunction(mHandle, G2D_GLOBAL_ALPHA, true);
+		enableFunction(mHandle, G2D_BLEND, true);
+	}
+
+	blitSurface(&sSurfaceX, &dSurfaceX);
+
+	if (layer->blendMode != BLENDING_NONE && !bypass) {
+		enableFunction(mHandle, G2D_BLEND, false);
+		enableFunction(mHandle, G2D_GLOBAL_ALPHA, false);
+	}
+    }
+
+    clearClipping();
+
+    return 0;
+}
+
+bool Composer::isFusableBottom(Layer* layer)
+{
+    if (mCompositeFunction == NULL || layer->isSolidColor() ||
+        layer->handle == NULL || layer->transform != 0) {
+        return false;
+    }
+
+    // the second input has no scaler and no color space converter.
+    Rect& srect = layer->sourceCrop;
+    Rect& drect = layer->displayFrame;
+    if (srect.width() != drect.width() || srect.height() != drect.height()) {
+        return false;
+    }
+
+    return !isYuvFormat(convertFormat(layer->handle->fslFormat, layer->handle));
+}
+
+bool Composer::isFusableTop(Layer* bottom, Layer* layer)
+{
+    if (layer->isSolidColor() || layer->handle == NULL ||
+        layer->transform != 0 || layer->blendMode == BLENDING_NONE) {
+        return false;
+    }
+
+    // bottom layer must be under the whole top layer.
+    Rect& drect = layer->displayFrame;
+    Rect& below = bottom->displayFrame;
+    return drect.left >= below.left && drect.top >= below.top &&
+           drect.right <= below.right && drect.bottom <= below.bottom;
+}
+
+void Composer::flushFusedBottom()
+{
+    if (mFuseBottom == NULL) {
+        return;
+    }
+
+    Layer* bottom = mFuseBottom;
+    mFuseBottom = NULL;
+    Region region = bottom->visibleRegion.intersect(mRepair);
+    composeRegion(bottom, region, true);
+}
+
+int Composer::composeFused(Layer* bottom, Layer* layer, Region& region)
+{
+    Region below = bottom->visibleRegion.intersect(mRepair);
+    Region fused = below.intersect(region);
+
+    // parts not covered by both layers are composed separately.
+    Region rest = below.subtract(fused);
+    composeRegion(bottom, rest, true);
+    rest = region.subtract(fused);
+    composeRegion(layer, rest, false);
+
+    Rect srect = layer->sourceCrop;
+    Rect drect = layer->displayFrame;
+    // part of bottom layer under the top layer display frame.
+    Rect brect = bottom->sourceCrop;
+    brect.left += drect.left - bottom->displayFrame.left;
+    brect.top += drect.top - bottom->displayFrame.top;
+    brect.right = brect.left + drect.width();
+    brect.bottom = brect.top + drect.height();
+
+    struct g2d_surfaceEx sSurfaceX, bSurfaceX, dSurfaceX;
+    memset(&sSurfaceX, 0, sizeof(sSurfaceX));
+    memset(&bSurfaceX, 0, sizeof(bSurfaceX));
+    memset(&dSurfaceX, 0, sizeof(dSurfaceX));
+    struct g2d_surface& sSurface = sSurfaceX.base;
+    struct g2d_surface& dSurface = dSurfaceX.base;
+    setG2dSurface(sSurfaceX, layer->handle, srect);
+    setG2dSurface(bSurfaceX, bottom->handle, brect);
+    setG2dSurface(dSurfaceX, mTarget, drect);
+    convertBlending(layer->blendMode, sSurface, dSurface);
+    sSurface.global_alpha = layer->planeAlpha;
+
+    enableFunction(mHandle, G2D_GLOBAL_ALPHA, true);
+    enableFunction(mHandle, G2D_BLEND, true);
+
+    size_t count = 0;
+    const Rect* visible = fused.getArray(&count);
+    for (size_t i=0; i<count; i++) {
+        Rect clip;
+        visible[i].intersect(drect, &clip);
+        if (clip.isEmpty()) {
+            continue;
+        }
+
+        setClipping(srect, drect, clip, 0);
+        compositeSurface(&sSurfaceX, &bSurfaceX, &dSurfaceX);
+    }
+
+    enableFunction(mHandle, G2D_BLEND, false);
+    enableFunction(mHandle, G2D_GLOBAL_ALPHA, false);
+    clearClipping();
+
+    return 0;
+}
+
+bool Composer::isSameSize(struct g2d_surface& src, struct g2d_surface& dst)
+{
+    int width = src.right - src.left;
+    int height = src.bottom - src.top;
+    if (dst.rot == G2D_ROTATION_90 || dst.rot == G2D_ROTATION_270) {
+        int temp = width;
+        width = height;
+        height = temp;
+    }
+
+    return width == dst.right - dst.left && height == dst.bottom - dst.top;
+}
+
+Rect Composer::mapClipToSource(const Rect& srect, const Rect& drect,
+                               const Rect& clip, int rot)
+{
+    struct g2d_surface src, dst;
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    setSurfaceRect(src, srect);
+    setSurfaceRect(dst, drect);
+    dst.rot = (enum g2d_rotation)rot;
+    g2d_clip_source(&src, &dst, clip.left - drect.left, clip.top - drect.top,
+                    clip.right - drect.left, clip.bottom - drect.top);
+
+    return getSurfaceRect(src);
+}
+
+int Composer::rotateClip(Layer* layer, struct g2d_surfaceEx& sSurfaceX,
+                         struct g2d_surfaceEx& dSurfaceX, Rect& clip, bool bypass)
+{
+    // the rotated clip has the clip size, split it in stripes of rows
+    // which fit in the scratch arena.
+    int rows = getArenaRows(clip.width());
+    if (rows <= 0 || rows >= clip.height()) {
+        return rotateStripe(layer, sSurfaceX, dSurfaceX, clip, bypass);
+    }
+
+    int ret = 0;
+    for (int top = clip.top; top < clip.bottom && ret == 0; top += rows) {
+        int bottom = (top + rows < clip.bottom) ? top + rows : clip.bottom;
+        Rect stripe(clip.left, top, clip.right, bottom);
+        struct g2d_surfaceEx sX = sSurfaceX;
+        struct g2d_surfaceEx dX = dSurfaceX;
+        ret = rotateStripe(layer, sX, dX, stripe, bypass);
+    }
+
+    return ret;
+}
+
+int Composer::rotateStripe(Layer* layer, struct g2d_surfaceEx& sSurfaceX,
+                           struct g2d_surfaceEx& dSurfaceX, Rect& clip, bool bypass)
+{
+    struct g2d_surface& sSurface = sSurfaceX.base;
+    struct g2d_surface& dSurface = dSurfaceX.base;
+    Rect srect(sSurface.left, sSurface.top, sSurface.right, sSurface.bottom);
+    Rect drect(dSurface.left, dSurface.top, dSurface.right, dSurface.bottom);
+    int rot = dSurface.rot;
+
+    Rect sub = mapClipToSource(srect, drect, clip, rot);
+    if (sub.isEmpty()) {
+        return 0;
+    }
+
+    int r = (rot == G2D_ROTATION_90 || rot == G2D_ROTATION_270) ? 1 : 0;
+    allocRotBuffer(sub.width(), sub.height(), r);
+    if (mRotBuffer == NULL) {
+        ALOGE("rotateStripe: no rotation buffer");
+        return -ENOMEM;
+    }
+
+    struct g2d_surfaceEx rSurfaceX;
+    memset(&rSurfaceX, 0, sizeof(rSurfaceX));
+    struct g2d_surface& rSurface = rSurfaceX.base;
+    Rect rrect = r ? Rect(sub.height(), sub.width()) :
+                     Rect(sub.width(), sub.height());
+    setG2dSurface(sSurfaceX, layer->handle, sub);
+    setG2dSurface(rSurfaceX, mRotBuffer, rrect);
+    rSurface.rot = rot;
+
+    rotateInto(layer, sSurfaceX, rSurfaceX);
+    rSurface.rot = G2D_ROTATION_0;
+    setG2dSurface(dSurfaceX, mTarget, clip);
+    dSurface.rot = G2D_ROTATION_0;
+    blendRotated(layer, rSurfaceX, dSurfaceX, bypass);
+
+    // scratch is not kept for the next clip rect.
+    mRotBuffer = NULL;
+    return 0;
+}
+
+bool Composer::isScaleFirst(struct g2d_surface& src, struct g2d_surface& dst)
+{
+    if (isSameSize(src, dst)) {
+        return false;
+    }
+
+    // bytes written and read back through the rotation buffer, the
+    // source is read once either way.
+    int bits = getFormatBits((enum g2d_format)dst.format);
+    int64_t srcPixels = (int64_t)(src.right - src.left) * (src.bottom - src.top);
+    int64_t dstPixels = (int64_t)(dst.right - dst.left) * (dst.bottom - dst.top);
+    int64_t rotateFirst = srcPixels * bits / 4;
+    int64_t scaleFirst = dstPixels * bits / 4;
+    return scaleFirst < rotateFirst;
+}
+
+int Composer::scaleRotateClip(Layer* layer, struct g2d_surfaceEx& sSurfaceX,
+                              struct g2d_surfaceEx& dSurfaceX, Rect& clip,
+                              bool bypass, bool* rotated)
+{
+    struct g2d_surface& dSurface = dSurfaceX.base;
+    Rect drect(dSurface.left, dSurface.top, dSurface.right, dSurface.bottom);
+
+    struct g2d_surfaceEx rSurfaceX;
+    memset(&rSurfaceX, 0, sizeof(rSurfaceX));
+    struct g2d_surface& rSurface = rSurfaceX.base;
+
+    // scale and rotate whole layer once into target sized buffer.
+    if (!*rotated) {
+        allocRotBuffer(drect.width(), drect.height(), 0);
+        if (mRotBuffer == NULL) {
+            ALOGE("scaleRotateClip: no rotation buffer");
+            return -ENOMEM;
+        }
+
+        Rect rrect(drect.width(), drect.height());
+        setG2dSurface(rSurfaceX, mRotBuffer, rrect);
+        rSurface.rot = dSurface.rot;
+        rotateInto(layer, sSurfaceX, rSurfaceX);
+        *rotated = true;
+        memset(&rSurfaceX, 0, sizeof(rSurfaceX));
+    }
+
+    if (mRotBuffer == NULL) {
+        return -ENOMEM;
+    }
+
+    Rect rrect = clip.offsetBy(-drect.left, -drect.top);
+    setG2dSurface(rSurfaceX, mRotBuffer, rrect);
+    setG2dSurface(dSurfaceX, mTarget, clip);
+    dSurface.rot = G2D_ROTATION_0;
+    return blendRotated(layer, rSurfaceX, dSurfaceX, bypass);
+}
+
+int Composer::rotateInto(Layer* layer, struct g2d_surfaceEx& sSurfaceX,
+                         struct g2d_surfaceEx& rSurfaceX)
+{
+    struct g2d_surface& sSurface = sSurfaceX.base;
+    struct g2d_surface& rSurface = rSurfaceX.base;
+
+    // clip rect is in target coordinates.
+    clearClipping();
+    enableFunction(mHandle, G2D_BLEND, true);
+    enableFunction(mHandle, G2D_GLOBAL_ALPHA, true);
+    sSurface.global_alpha = layer->planeAlpha;
+    sSurface.blendfunc = G2D_ONE; //enable alpha
+    rSurface.blendfunc = G2D_ZERO;
+    return blitSurface(&sSurfaceX, &rSurfaceX); // just rotate please
+}
+
+int Composer::blendRotated(Layer* layer, struct g2d_surfaceEx& rSurfaceX,
+                           struct g2d_surfaceEx& dSurfaceX, bool bypass)
+{
+    struct g2d_surface& rSurface = rSurfaceX.base;
+    struct g2d_surface& dSurface = dSurfaceX.base;
+
+    bool blend = (layer->blendMode != BLENDING_NONE && !bypass);
+    enableFunction(mHandle, G2D_BLEND, blend);
+    enableFunction(mHandle, G2D_GLOBAL_ALPHA, blend);
+    if (!bypass)
+        convertBlending(layer->blendMode, rSurface, dSurface);
+    rSurface.global_alpha = layer->planeAlpha;
+    int ret = blitSurface(&rSurfaceX, &dSurfaceX);
+
+    if (blend) {
+        enableFunction(mHandle, G2D_BLEND, false);
+        enableFunction(mHandle, G2D_GLOBAL_ALPHA, false);
+    }
+
+    return ret;
+}
+
+int Composer::fillSolidLayer(Layer* layer, Region& region)
+{
+    // opaque solid color needs no source, fill visible rects directly.
+    Rect drect = layer->displayFrame;
+    size_t count = 0;
+    const Rect* visible = region.getArray(&count);
+    for (size_t i=0; i<count; i++) {
+        Rect clip;
+        visible[i].intersect(drect, &clip);
+        if (clip.isEmpty()) {
+            continue;
+        }
+
+        fillRect(mTarget, clip, layer->color);
+    }
+
+    return 0;
+}
+
+int Composer::setG2dSurface(struct g2d_surfaceEx& surfaceX, Memory *handle, Rect& rect)
+{
+    int index = -1;
+    for (int i = 0; i < SURFACE_CACHE_SIZE; i++) {
+        SurfaceEntry& entry = mSurfaceCache[i];
+        if (entry.memory == handle) {
+            index = i;
+            break;
+        }
+        // prefer a free slot, then the least recently used one.
+        if (index < 0 || (mSurfaceCache[index].memory != NULL &&
+            (entry.memory == NULL ||
+             entry.lastUsed < mSurfaceCache[index].lastUsed))) {
+            index = i;
+        }
+    }
+
+    // buffer changed behind the same handle, describe it again.
+    SurfaceEntry& entry = mSurfaceCache[index];
+    if (entry.memory != handle || entry.phys != (uint64_t)handle->phys ||
+        entry.width != handle->width || entry.height != handle->height ||
+        entry.stride != handle->stride ||
+        entry.fslFormat != handle->fslFormat) {
+        entry.memory = handle;
+        entry.phys = (uint64_t)handle->phys;
+        entry.width = handle->width;
+        entry.height = handle->height;
+        entry.stride = handle->stride;
+        entry.fslFormat = handle->fslFormat;
+        memset(&entry.surfaceX, 0, sizeof(entry.surfaceX));
+        buildG2dSurface(entry.surfaceX, handle);
+    }
+    entry.lastUsed = mFrameCount;
+
+    struct g2d_surface& surface = surfaceX.base;
+    struct g2d_surface& cached = entry.surfaceX.base;
+    surfaceX.tiling = entry.surfaceX.tiling;
+    surface.format = cached.format;
+    surface.stride = cached.stride;
+    surface.planes[0] = cached.planes[0];
+    surface.planes[1] = cached.planes[1];
+    surface.planes[2] = cached.planes[2];
+    surface.left = rect.left;
+    surface.top = rect.top;
+    surface.right = rect.right;
+    surface.bottom = rect.bottom;
+    surface.width = cached.width;
+    surface.height = cached.height;
+
+    return 0;
+}
+
+int Composer::buildG2dSurface(struct g2d_surfaceEx& surfaceX, Memory *handle)
+{
+    int alignWidth = 0, alignHeight = 0;
+    struct g2d_surface& surface = surfaceX.base;
+
+    int ret = getAlignedSize(handle, NULL, &alignHeight);
+    if (ret != 0) {
+        alignHeight = handle->height;
+    }
+
+    alignWidth = handle->stride;
+    surface.format = convertFormat(handle->fslFormat, handle);
+    surface.stride = alignWidth;
+    enum g2d_tiling tile = G2D_LINEAR;
+    getTiling(handle, &tile);
+    surfaceX.tiling = tile;
+
+    int offset = 0;
+    getFlipOffset(handle, &offset);
+    surface.planes[0] = getPlaneAddress(handle) + offset;
+
+    SurfaceBuilder builder = getSurfaceBuilder(surface.format);
+    if (builder != NULL) {
+        (*builder)(surface, handle->height, alignHeight);
+    }
+    else {
+        ALOGI("does not support format:%d", surface.format);
+    }
+    surface.width = handle->width;
+    surface.height = handle->height;
+
+    return 0;
+}
+
+enum g2d_format Composer::convertFormat(int format, Memory *handle)
+{
+    // HAL format of each entry of the table shared with libg2d.
+    static const struct {
+        int hal;
+        enum g2d_format format;
+    } sFormats[] = {
+#define G2D_FORMAT(fmt, pxp, bpp, bits, layout, yuv, hal)             \
+        { hal, fmt },
+        G2D_FORMAT_TABLE
+#undef G2D_FORMAT
+    };
+
+    size_t count = sizeof(sFormats) / sizeof(sFormats[0]);
+    for (size_t i=0; i<count; i++) {
+        if (sFormats[i].hal != 0 && sFormats[i].hal == format) {
+            return alterFormat(handle, sFormats[i].format);
+        }
+    }
+
+    ALOGE("unsupported format:0x%x", format);
+    return alterFormat(handle, G2D_RGBA8888);
+}
+
+int Composer::convertRotation(int transform, struct g2d_surface& src,
+                        struct g2d_surface& dst)
+{
+    switch (transform) {
+        case 0:
+            dst.rot = G2D_ROTATION_0;
+            break;
+        case TRANSFORM_ROT90:
+            dst.rot =  G2D_ROTATION_90;
+            break;
+        case TRANSFORM_FLIPH | TRANSFORM_FLIPV:
+            dst.rot =  G2D_ROTATION_180;
+            break;
+        case TRANSFORM_FLIPH | TRANSFORM_FLIPV
+             | HAL_TRANSFORM_ROT_90:
+            dst.rot =  G2D_ROTATION_270;
+            break;
+        case TRANSFORM_FLIPH:
+//            dst.rot =  G2D_FLIP_H;
+              src.rot =  G2D_FLIP_H;
+            break;
+        case TRANSFORM_FLIPV:
+//            dst.rot =  G2D_FLIP_V;
+            src.rot =  G2D_FLIP_V;
+            break;
+        case TRANSFORM_FLIPH | TRANSFORM_ROT90:
+            dst.rot =  G2D_ROTATION_90;
+            src.rot =  G2D_FLIP_H;
+            break;
+        case TRANSFORM_FLIPV | TRANSFORM_ROT90:
+            dst.rot =  G2D_ROTATION_90;
+            src.rot =  G2D_FLIP_V;
+            break;
+        default:
+            dst.rot =  G2D_ROTATION_0;
+            break;
+    }
+
+    return 0;
+}
+
+
+//    BLENDING_NONE     = 0x0100,
+int Composer::convertBlending(int blending, struct g2d_surface& src,
+                        struct g2d_surface& dst)
+{
+    switch (blending) {
+        case BLENDING_PREMULT: //0x0105
+            src.blendfunc = G2D_ONE;
+            dst.blendfunc = G2D_ONE_MINUS_SRC_ALPHA;
+            break;
+
+        case BLENDING_COVERAGE: //0x0405
+            src.blendfunc = G2D_SRC_ALPHA;
+            dst.blendfunc = G2D_ONE_MINUS_SRC_ALPHA;
+            break;
+
+        case BLENDING_DIM: //0x0805
+            src.blendfunc = G2D_ONE;
+            dst.blendfunc = G2D_ONE_MINUS_SRC_ALPHA;
+            break;
+
+        default:
+            src.blendfunc = G2D_ONE;
+            dst.blendfunc = G2D_ONE_MINUS_SRC_ALPHA;
+            break;
+    }
 
-        if (!layer->isSolidColor()) {
-	    if (layer->handle == NULL) continue;
-            setG2dSurface(sSurfaceX, layer->handle, srect);
-	} else {
-	    if (mDimBuffer == NULL) continue;
-            setG2dSurface(sSurfaceX, mDimBuffer, drect);
-	}
+    return 0;
+}
 
-	memset(&dSurfaceX, 0, sizeof(dSurfaceX));
-        setG2dSurface(dSurfaceX, mTarget, drect);
+int Composer::getAlignedSize(Memory *handle, int *width, int *height)
+{
+    if (mGetAlignedSize == NULL) {
+        return -EINVAL;
+    }
 
-        convertRotation(layer->transform, sSurface, dSurface);
+    return (*mGetAlignedSize)(handle, (void*)width, (void*)height);
+}
 
-//workaround for "e8151: PXP: Rotation Engine alignment and operation combination limitations"
-	if (dSurface.rot != G2D_ROTATION_0) { //90 180 270
+int Composer::getFlipOffset(Memory *handle, int *offset)
+{
+    if (mGetFlipOffset == NULL) {
+        return -EINVAL;
+    }
 
-		struct g2d_surfaceEx rSurfaceX;
-		memset(&rSurfaceX, 0, sizeof(rSurfaceX));
-    		struct g2d_surface& rSurface = rSurfaceX.base;
+    return (*mGetFlipOffset)(handle, (void*)offset);
+}
 
-		int r = ((dSurface.rot == G2D_ROTATION_90) || (dSurface.rot == G2D_ROTATION_270)) ? 1 : 0;
+bool Composer::isLayerReadable(Layer* layer)
+{
+    if (layer->isSolidColor() || layer->handle == NULL) {
+        return true;
+    }
 
-		allocRotBuffer(layer->handle->width,layer->handle->height, r);
+    // CPU composite needs a mapped buffer in a format it knows.
+    if (mSoftware) {
+        Memory* handle = layer->handle;
+        if (handle->base == 0) {
+            mapCpuBuffer(handle);
+        }
+        return handle->base != 0 &&
+               SoftEngine::isSupported(convertFormat(handle->fslFormat, handle));
+    }
 
-		if (mRotBuffer == NULL) {
-		        ALOGE("rotBuffer == NULL !");
-			continue;
-		}
+    // GPU tiled buffers can't be read.
+    enum g2d_tiling tile = G2D_LINEAR;
+    getTiling(layer->handle, &tile);
+    return (tile & ~G2D_LINEAR) == 0;
+}
 
-		if (r) {
-			rrect.left   = sSurface.top;
-			rrect.right  = sSurface.bottom;
-			rrect.top    = sSurface.left;
-			rrect.bottom = sSurface.right;
-		} else {
-			rrect.left   = sSurface.left;
-			rrect.right  = sSurface.right;
-			rrect.top    = sSurface.top;
-			rrect.bottom = sSurface.bottom;
-		}
+bool Composer::isCpuMapped(Memory* handle)
+{
+    // CPU composite reaches targets and scratch buffers by their mapping.
+    if (mSoftware && handle->base == 0) {
+        ALOGE("%s buffer w:%d, h:%d not mapped, can't compose on CPU",
+              __func__, handle->width, handle->height);
+        return false;
+    }
 
-	        setG2dSurface(rSurfaceX, mRotBuffer, rrect);
-	        rSurface.rot = dSurface.rot;
-		dSurface.rot = sSurface.rot;
-		sSurface.rot = G2D_ROTATION_0; //discard flip
+    return true;
+}
 
-		enableFunction(mHandle, G2D_BLEND, true);
-		enableFunction(mHandle, G2D_GLOBAL_ALPHA, true);
-	        sSurface.global_alpha = layer->planeAlpha;
-		sSurface.blendfunc = G2D_ONE; //enable alpha
-		rSurface.blendfunc = G2D_ZERO;
-	        blitSurface(&sSurfaceX, &rSurfaceX); // just rotate please
-		rSurface.rot = G2D_ROTATION_0;
+void Composer::mapCpuBuffer(Memory* handle)
+{
+    // gralloc maps a buffer into this process on its first CPU lock, the
+    // mapping stays until the buffer is released.
+    MemoryManager* pManager = MemoryManager::getInstance();
+    void* vaddr = NULL;
+    int ret = pManager->lock(handle, USAGE_SW_READ_OFTEN, 0, 0,
+                             handle->width, handle->height, &vaddr);
+    if (ret != 0) {
+        ALOGW("%s lock buffer w:%d, h:%d failed", __func__,
+              handle->width, handle->height);
+        return;
+    }
+    pManager->unlock(handle);
+}
 
+int Composer::getPlaneAddress(Memory* handle)
+{
+    // the software engine addresses surfaces by CPU address.
+    if (mSoftware) {
+        return (int)(uintptr_t)handle->base;
+    }
 
-	        if (layer->blendMode == BLENDING_NONE || bypass) {
-			enableFunction(mHandle, G2D_BLEND, false);
-			enableFunction(mHandle, G2D_GLOBAL_ALPHA, false);
-		}
+    return (int)handle->phys;
+}
 
-		if (!bypass)
-			convertBlending(layer->blendMode, rSurface, dSurface);
+int Composer::getTiling(Memory *handle, enum g2d_tiling* tile)
+{
+    if (mGetTiling == NULL) {
+        return -EINVAL;
+    }
 
-	        rSurface.global_alpha = layer->planeAlpha;
+    return (*mGetTiling)(handle, (void*)tile);
+}
 
-		blitSurface(&rSurfaceX, &dSurfaceX);
+enum g2d_format Composer::alterFormat(Memory *handle, enum g2d_format format)
+{
+    if (mAlterFormat == NULL) {
+        return format;
+    }
 
-	        if (layer->blendMode != BLENDING_NONE && !bypass) {
-			enableFunction(mHandle, G2D_BLEND, false);
-			enableFunction(mHandle, G2D_GLOBAL_ALPHA, false);
-		}
+    return (enum g2d_format)(*mAlterFormat)(handle, (void*)format);
+}
 
-		continue;
-	}
+int Composer::lockSurface(Memory *handle)
+{
+    if (mLockSurface == NULL) {
+        return -EINVAL;
+    }
 
-	if (!bypass)
-	       	convertBlending(layer->blendMode, sSurface, dSurface);
-	sSurface.global_alpha = layer->planeAlpha;
+    return (*mLockSurface)(handle);
+}
 
-	if (layer->blendMode != BLENDING_NONE && !bypass) {
-		enableFunction(mHandle, G2D_GLOBAL_ALPHA, true);
-		enableFunction(mHandle, G2D_BLEND, true);
-	}
+int Composer::unlockSurface(Memory *handle)
+{
+    if (mUnlockSurface == NULL) {
+        return -EINVAL;
+    }
 
-	blitSurface(&sSurfaceX, &dSurfaceX);
+    return (*mUnlockSurface)(handle);
+}
 
-	if (layer->blendMode != BLENDING_NONE && !bypass) {
-		enableFunction(mHandle, G2D_BLEND, false);
-		enableFunction(mHandle, G2D_GLOBAL_ALPHA, false);
-	}
+int Composer::setClipping(Rect& src, Rect& dst, Rect& clip, int rotation)
+{
+    if (mSetClipping == NULL) {
+        return -EINVAL;
     }
 
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = CMD_CLIP;
+    cmd.clip = clip;
+    mCommands.add(cmd);
     return 0;
 }
 
-int Composer::setG2dSurface(struct g2d_surfaceEx& surfaceX, Memory *handle, Rect& rect)
+int Composer::clearClipping()
 {
-    int alignWidth = 0, alignHeight = 0;
-    struct g2d_surface& surface = surfaceX.base;
+    if (mSetClipping == NULL) {
+        return -EINVAL;
+    }
 
-    int ret = getAlignedSize(handle, NULL, &alignHeight);
-    if (ret != 0) {
-        alignHeight = handle->height;
+    // empty clip rect disables clipping.
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = CMD_CLIP;
+    cmd.clip = Rect(0, 0);
+    mCommands.add(cmd);
+    return 0;
+}
+
+static int getChannelOrder(int format)
+{
+    switch (format) {
+        case G2D_RGBA8888:
+        case G2D_RGBX8888:
+            return 1;
+        case G2D_BGRA8888:
+        case G2D_BGRX8888:
+            return 2;
+        default:
+            return 0;
     }
+}
 
-    alignWidth = handle->stride;
-    surface.format = convertFormat(handle->fslFormat, handle);
-    surface.stride = alignWidth;
-    enum g2d_tiling tile = G2D_LINEAR;
-    getTiling(handle, &tile);
-    surfaceX.tiling = tile;
+static bool isFlipOnly(int rot)
+{
+    return rot == G2D_ROTATION_0 || rot == G2D_FLIP_H || rot == G2D_FLIP_V;
+}
+
+int Composer::blitSurface(struct g2d_surfaceEx *srcEx, struct g2d_surfaceEx *dstEx)
+{
+    if (mBlitFunction == NULL) {
+        return -EINVAL;
+    }
+
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = CMD_BLIT;
+    cmd.src = *srcEx;
+    cmd.dst = *dstEx;
+    // rotated blits may get split with CPU, see splitRotatedBlits.
+    Rect area = getSurfaceRect(dstEx->base);
+    if (mSoftware || area.width() * area.height() <= CPU_BLIT_MAX_PIXELS ||
+        !isFlipOnly(dstEx->base.rot)) {
+        cmd.srcBase = getSurfaceBase(srcEx->base.planes[0], &cmd.srcMemory);
+        cmd.dstBase = getSurfaceBase(dstEx->base.planes[0], &cmd.dstMemory);
+    }
+    mCommands.add(cmd);
+    return 0;
+}
+
+int Composer::compositeSurface(struct g2d_surfaceEx *srcEx,
+                struct g2d_surfaceEx *bgEx, struct g2d_surfaceEx *dstEx)
+{
+    if (mCompositeFunction == NULL) {
+        return -EINVAL;
+    }
+
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = CMD_COMPOSITE;
+    cmd.src = *srcEx;
+    cmd.bg = *bgEx;
+    cmd.dst = *dstEx;
+    if (mSoftware) {
+        cmd.srcBase = getSurfaceBase(srcEx->base.planes[0], &cmd.srcMemory);
+        getSurfaceBase(bgEx->base.planes[0], &cmd.bgMemory);
+        cmd.dstBase = getSurfaceBase(dstEx->base.planes[0], &cmd.dstMemory);
+    }
+    mCommands.add(cmd);
+    return 0;
+}
+
+/*
+ * libg2d turns blending off on a blit of an opaque YUV source, the blit
+ * and everything after it until blending is enabled again don't blend.
+ */
+bool Composer::isBlendClearingBlit(const Command& cmd)
+{
+    return cmd.type == CMD_BLIT && isYuvFormat(cmd.src.base.format) &&
+           cmd.src.base.global_alpha == 0xff;
+}
+
+void Composer::cullCommands(Vector<Command>& commands, Vector<bool>& dead)
+{
+    size_t count = commands.size();
+    dead.clear();
+    dead.insertAt(false, 0, count);
+
+    // blend state and clip rect each command is executed with, unknown
+    // blend state is taken as enabled.
+    Vector<bool> blend;
+    Vector<Rect> clip;
+    int caps = mCapState[G2D_BLEND];
+    Rect current = mClipValid ? mClipState : Rect(0, 0);
+    for (size_t i=0; i<count; i++) {
+        const Command& cmd = commands[i];
+        if (cmd.type == CMD_ENABLE && cmd.cap == G2D_BLEND) {
+            caps = cmd.enable ? 1 : 0;
+        }
+        else if (cmd.type == CMD_CLIP) {
+            current = cmd.clip;
+        }
+        else if (isBlendClearingBlit(cmd)) {
+            caps = 0;
+        }
+        blend.add(caps != 0);
+        clip.add(current);
+    }
+
+    // walk backwards, a write is dead when later opaque writes cover it
+    // before anything reads those pixels.
+    KeyedVector<int, Region> covered;
+    for (size_t i=count; i>0; i--) {
+        const Command& cmd = commands[i-1];
+        if (cmd.type != CMD_FILL && cmd.type != CMD_BLIT &&
+            cmd.type != CMD_COMPOSITE) {
+            continue;
+        }
+
+        Rect area = getSurfaceRect(cmd.dst.base);
+        if (cmd.type != CMD_FILL && mSetClipping != NULL &&
+            !clip[i-1].isEmpty()) {
+            area.intersect(clip[i-1], &area);
+        }
+
+        int plane = cmd.dst.base.planes[0];
+        ssize_t index = covered.indexOfKey(plane);
+        if (index < 0) {
+            index = covered.add(plane, Region());
+        }
+
+        Region& target = covered.editValueAt(index);
+        if (Region(area).subtract(target).isEmpty()) {
+            dead.editItemAt(i-1) = true;
+            continue;
+        }
+
+        bool readsTarget = (cmd.type == CMD_BLIT && blend[i-1]);
+        if (readsTarget) {
+            target.subtractSelf(area);
+        }
+        else {
+            target.orSelf(area);
+        }
+
+        // sources must keep what earlier commands wrote in them.
+        for (int s = 0; s < 2; s++) {
+            const struct g2d_surface& src = s ? cmd.bg.base : cmd.src.base;
+            if (cmd.type == CMD_FILL || (s && cmd.type != CMD_COMPOSITE)) {
+                continue;
+            }
+            ssize_t sIndex = covered.indexOfKey(src.planes[0]);
+            if (sIndex >= 0) {
+                covered.editValueAt(sIndex).subtractSelf(getSurfaceRect(src));
+            }
+        }
+    }
+}
+
+void Composer::applyState(int* caps, Rect& clip, bool withClip)
+{
+    for (int i = 0; i < CAP_STATE_SIZE; i++) {
+        if (caps[i] < 0 || caps[i] == mCapState[i]) {
+            continue;
+        }
+
+        mCapState[i] = caps[i];
+        if (caps[i]) {
+            (*mEnableFunction)(mHandle, (void*)(intptr_t)i);
+        }
+        else {
+            (*mDisableFunction)(mHandle, (void*)(intptr_t)i);
+        }
+    }
+
+    if (!withClip || (mClipValid && clip == mClipState)) {
+        return;
+    }
+
+    mClipState = clip;
+    mClipValid = true;
+    (*mSetClipping)(mHandle, (void*)(intptr_t)clip.left,
+            (void*)(intptr_t)clip.top, (void*)(intptr_t)clip.right,
+            (void*)(intptr_t)clip.bottom);
+}
+
+int Composer::submitCommands(Vector<Command>& commands, int targetPlane,
+                             Vector<CpuBlit>& cpuBlits)
+{
+    // state requested by the commands, applied only before it is used.
+    int caps[CAP_STATE_SIZE];
+    for (int i = 0; i < CAP_STATE_SIZE; i++) {
+        caps[i] = -1;
+    }
+    Rect clip(0, 0);
+
+    Vector<bool> dead;
+    cullCommands(commands, dead);
+    Vector<bool> cpu;
+    mStripes.clear();
+    if (!mSoftware) {
+        pickCpuBlits(commands, dead, targetPlane, cpu);
+        splitRotatedBlits(commands, dead, targetPlane);
+    }
+    else {
+        cpu.insertAt(false, 0, commands.size());
+    }
+    cpuBlits.clear();
+
+    mFrameTasks = 0;
+    mFramePixels = 0;
+    mSubmitStart = systemTime(SYSTEM_TIME_MONOTONIC);
+    size_t count = commands.size();
+    for (size_t i=0; i<count; i++) {
+        Command& cmd = commands.editItemAt(i);
+        if (dead[i]) {
+            ALOGV("submitCommands: drop overwritten command %d", cmd.type);
+            continue;
+        }
+
+        if (cpu[i]) {
+            CpuBlit blit;
+            blit.index = i;
+            blit.blend = (caps[G2D_BLEND] < 0) ?
+                    (mCapState[G2D_BLEND] > 0) : (caps[G2D_BLEND] > 0);
+            blit.globalAlpha = (caps[G2D_GLOBAL_ALPHA] < 0) ?
+                    (mCapState[G2D_GLOBAL_ALPHA] > 0) :
+                    (caps[G2D_GLOBAL_ALPHA] > 0);
+            blit.clip = (mSetClipping != NULL) ? clip : Rect(0, 0);
+            cpuBlits.add(blit);
+            continue;
+        }
+
+        switch (cmd.type) {
+            case CMD_ENABLE:
+                caps[cmd.cap] = cmd.enable ? 1 : 0;
+                continue;
+
+            case CMD_CLIP:
+                clip = cmd.clip;
+                continue;
+
+            case CMD_FILL:
+                (*mClearFunction)(mHandle, &cmd.dst.base);
+                break;
+
+            case CMD_BLIT:
+                applyState(caps, clip, mSetClipping != NULL);
+                (*mBlitFunction)(mHandle, &cmd.src, &cmd.dst);
+                if (isBlendClearingBlit(cmd)) {
+                    caps[G2D_BLEND] = 0;
+                    mCapState[G2D_BLEND] = 0;
+                }
+                break;
+
+            case CMD_COMPOSITE:
+                applyState(caps, clip, mSetClipping != NULL);
+                (*mCompositeFunction)(mHandle, &cmd.src.base,
+                                      &cmd.bg.base, &cmd.dst.base);
+                break;
+
+            default:
+                continue;
+        }
+        Rect area = getSurfaceRect(cmd.dst.base);
+        mFramePixels += area.width() * area.height();
+        mFrameTasks++;
+    }
+
+    return 0;
+}
+
+void Composer::updateTaskCost()
+{
+    // submit to completion of frames made of small tasks is dominated by
+    // the fixed cost of each task, frames of larger ones by pixel work.
+    if (mFrameTasks == 0 ||
+        mFramePixels > (int64_t)mFrameTasks * CPU_BLIT_MAX_PIXELS) {
+        return;
+    }
+
+    // per task cost in ns, smoothed over about eight frames.
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - mSubmitStart;
+    mTaskCost = (mTaskCost * 7 + elapsed / mFrameTasks) / 8;
+}
+
+int Composer::getCpuThreshold()
+{
+    // pixels CPU blits in the time one PXP task takes to set up.
+    int64_t pixels = mTaskCost * mCpuRate / 1000;
+    return (pixels < CPU_BLIT_MAX_PIXELS) ? (int)pixels : CPU_BLIT_MAX_PIXELS;
+}
+
+bool Composer::isCpuBlit(const Command& cmd, int targetPlane, bool blend)
+{
+    const struct g2d_surface& dst = cmd.dst.base;
+    if (cmd.dstBase == 0 || dst.planes[0] != targetPlane) {
+        return false;
+    }
+
+    Rect drect = getSurfaceRect(dst);
+    if (drect.width() * drect.height() > getCpuThreshold()) {
+        return false;
+    }
+
+    if (cmd.type == CMD_FILL) {
+        return getChannelOrder(dst.format) != 0 || dst.format == G2D_RGB565;
+    }
+
+    const struct g2d_surface& src = cmd.src.base;
+    if (cmd.type != CMD_BLIT || cmd.srcBase == 0 ||
+        !isFlipOnly(src.rot) || !isFlipOnly(dst.rot)) {
+        return false;
+    }
+
+    Rect srect = getSurfaceRect(src);
+    if (srect.width() != drect.width() || srect.height() != drect.height()) {
+        return false;
+    }
+
+    if (!blend) {
+        return (src.format == G2D_RGB565 && dst.format == G2D_RGB565) ||
+               (getChannelOrder(src.format) != 0 &&
+                getChannelOrder(src.format) == getChannelOrder(dst.format));
+    }
 
-    int offset = 0;
-    getFlipOffset(handle, &offset);
-    surface.planes[0] = (int)handle->phys + offset;
+    int fs = src.blendfunc & 0xf;
+    return (dst.blendfunc & 0xf) == G2D_ONE_MINUS_SRC_ALPHA &&
+           (fs == G2D_ONE || fs == G2D_SRC_ALPHA) &&
+           getChannelOrder(src.format) != 0 &&
+           getChannelOrder(src.format) == getChannelOrder(dst.format);
+}
 
-    switch (surface.format) {
-        case G2D_RGB565:
-        case G2D_YUYV:
-        case G2D_RGBA8888:
-        case G2D_BGRA8888:
-        case G2D_RGBX8888:
-        case G2D_BGRX8888:
-            break;
+void Composer::pickCpuBlits(Vector<Command>& commands, Vector<bool>& dead,
+                            int targetPlane, Vector<bool>& cpu)
+{
+    size_t count = commands.size();
+    cpu.clear();
+    cpu.insertAt(false, 0, count);
+
+    // blend state each command is executed with, unknown state is not
+    // done by CPU.
+    Vector<int> blend;
+    int caps = mCapState[G2D_BLEND];
+    for (size_t i=0; i<count; i++) {
+        const Command& cmd = commands[i];
+        if (cmd.type == CMD_ENABLE && cmd.cap == G2D_BLEND) {
+            caps = cmd.enable ? 1 : 0;
+        }
+        else if (isBlendClearingBlit(cmd)) {
+            caps = 0;
+        }
+        blend.add(caps);
+    }
 
-        case G2D_NV16:
-        case G2D_NV12:
-        case G2D_NV21:
-            surface.planes[1] = surface.planes[0] + surface.stride * alignHeight;
-            break;
+    // CPU blits run after the engine finished, so nothing the engine does
+    // later in the frame may read or write the same pixels.
+    KeyedVector<int, Region> touched;
+    for (size_t i=count; i>0; i--) {
+        const Command& cmd = commands[i-1];
+        if (dead[i-1] || (cmd.type != CMD_FILL && cmd.type != CMD_BLIT &&
+            cmd.type != CMD_COMPOSITE)) {
+            continue;
+        }
+
+        Rect area = getSurfaceRect(cmd.dst.base);
+        ssize_t index = touched.indexOfKey(cmd.dst.base.planes[0]);
+        bool untouched = (index < 0) ||
+                    Region(area).intersect(touched.valueAt(index)).isEmpty();
+        if (untouched && cmd.type == CMD_BLIT) {
+            index = touched.indexOfKey(cmd.src.base.planes[0]);
+            untouched = (index < 0) || Region(getSurfaceRect(cmd.src.base))
+                    .intersect(touched.valueAt(index)).isEmpty();
+        }
 
-        case G2D_I420:
-        case G2D_YV12: {
-            int c_stride = (alignWidth/2+15)/16*16;
-            int stride = alignWidth;
+        if (untouched && (cmd.type == CMD_FILL || blend[i-1] >= 0) &&
+            isCpuBlit(cmd, targetPlane, blend[i-1] > 0)) {
+            cpu.editItemAt(i-1) = true;
+            continue;
+        }
 
-            surface.stride = alignWidth;
-            if (surface.format == G2D_I420) {
-                surface.planes[1] = surface.planes[0] + stride * handle->height;
-                surface.planes[2] = surface.planes[1] + c_stride * handle->height/2;
+        for (int s = 0; s < 3; s++) {
+            const struct g2d_surface& surface = (s == 0) ? cmd.dst.base :
+                    ((s == 1) ? cmd.src.base : cmd.bg.base);
+            if ((s == 1 && cmd.type == CMD_FILL) ||
+                (s == 2 && cmd.type != CMD_COMPOSITE)) {
+                continue;
             }
-            else {
-                surface.planes[2] = surface.planes[0] + stride * handle->height;
-                surface.planes[1] = surface.planes[2] + c_stride * handle->height/2;
+            index = touched.indexOfKey(surface.planes[0]);
+            if (index < 0) {
+                index = touched.add(surface.planes[0], Region());
             }
-            } break;
+            touched.editValueAt(index).orSelf(getSurfaceRect(surface));
+        }
+    }
+}
 
-        default:
-            ALOGI("does not support format:%d", surface.format);
-            break;
+uintptr_t Composer::getSurfaceBase(int plane, Memory** memory)
+{
+    *memory = NULL;
+    for (int i = 0; i < SURFACE_CACHE_SIZE; i++) {
+        SurfaceEntry& entry = mSurfaceCache[i];
+        if (entry.memory == NULL || entry.surfaceX.base.planes[0] != plane) {
+            continue;
+        }
+
+        if (entry.memory->base == 0) {
+            return 0;
+        }
+        *memory = entry.memory;
+        return (uintptr_t)entry.memory->base + plane - (int)entry.phys;
     }
-    surface.left = rect.left;
-    surface.top = rect.top;
-    surface.right = rect.right;
-    surface.bottom = rect.bottom;
-    surface.width = handle->width;
-    surface.height = handle->height;
 
     return 0;
 }
 
-enum g2d_format Composer::convertFormat(int format, Memory *handle)
+void Composer::addCpuBuffer(Vector<Memory*>& buffers, Memory* memory)
 {
-    enum g2d_format halFormat;
-    switch (format) {
-        case FORMAT_RGBA8888:
-            halFormat = G2D_RGBA8888;
-            break;
-        case FORMAT_RGBX8888:
-            halFormat = G2D_RGBX8888;
-            break;
-        case FORMAT_RGB565:
-            halFormat = G2D_RGB565;
-            break;
-        case FORMAT_BGRA8888:
-            halFormat = G2D_BGRA8888;
-            break;
-
-        case FORMAT_NV21:
-            halFormat = G2D_NV21;
-            break;
-        case FORMAT_NV12:
-            halFormat = G2D_NV12;
-            break;
+    if (memory == NULL) {
+        return;
+    }
 
-        case FORMAT_I420:
-            halFormat = G2D_I420;
-            break;
-        case FORMAT_YV12:
-            halFormat = G2D_YV12;
-            break;
+    for (size_t i=0; i<buffers.size(); i++) {
+        if (buffers[i] == memory) {
+            return;
+        }
+    }
+    buffers.add(memory);
+}
 
-        case FORMAT_NV16:
-            halFormat = G2D_NV16;
-            break;
-        case FORMAT_YUYV:
-            halFormat = G2D_YUYV;
-            break;
+/*
+ * buffers are shared with the engine and the display, gralloc lock
+ * invalidates CPU caches for what the engine wrote and unlock cleans
+ * what CPU wrote before the engine or display reads it.
+ */
+void Composer::lockCpuBuffers(Vector<Memory*>& buffers)
+{
+    // buffers failing to lock are removed, only locked ones get unlocked.
+    MemoryManager* pManager = MemoryManager::getInstance();
+    for (size_t i=buffers.size(); i>0; i--) {
+        Memory* memory = buffers[i-1];
+        void* vaddr = NULL;
+        int ret = pManager->lock(memory,
+                USAGE_SW_READ_OFTEN | USAGE_SW_WRITE_OFTEN,
+                0, 0, memory->width, memory->height, &vaddr);
+        if (ret != 0) {
+            ALOGW("%s lock buffer w:%d, h:%d failed", __func__,
+                  memory->width, memory->height);
+            buffers.removeAt(i-1);
+        }
+    }
+}
 
-        default:
-            ALOGE("unsupported format:0x%x", format);
-            halFormat = G2D_RGBA8888;
-            break;
+bool Composer::hasCpuBuffer(const Vector<Memory*>& buffers, Memory* memory)
+{
+    for (size_t i=0; i<buffers.size(); i++) {
+        if (buffers[i] == memory) {
+            return true;
+        }
     }
 
-    halFormat = alterFormat(handle, halFormat);
-    return halFormat;
+    return false;
 }
 
-int Composer::convertRotation(int transform, struct g2d_surface& src,
-                        struct g2d_surface& dst)
+void Composer::lockFrameBuffers(Vector<Command>& commands,
+                                Vector<Memory*>& buffers)
 {
-    switch (transform) {
-        case 0:
-            dst.rot = G2D_ROTATION_0;
-            break;
-        case TRANSFORM_ROT90:
-            dst.rot =  G2D_ROTATION_90;
-            break;
-        case TRANSFORM_FLIPH | TRANSFORM_FLIPV:
-            dst.rot =  G2D_ROTATION_180;
-            break;
-        case TRANSFORM_FLIPH | TRANSFORM_FLIPV
-             | HAL_TRANSFORM_ROT_90:
-            dst.rot =  G2D_ROTATION_270;
-            break;
-        case TRANSFORM_FLIPH:
-//            dst.rot =  G2D_FLIP_H;
-              src.rot =  G2D_FLIP_H;
-            break;
-        case TRANSFORM_FLIPV:
-//            dst.rot =  G2D_FLIP_V;
-            src.rot =  G2D_FLIP_V;
-            break;
-        case TRANSFORM_FLIPH | TRANSFORM_ROT90:
-            dst.rot =  G2D_ROTATION_90;
-            src.rot =  G2D_FLIP_H;
-            break;
-        case TRANSFORM_FLIPV | TRANSFORM_ROT90:
-            dst.rot =  G2D_ROTATION_90;
-            src.rot =  G2D_FLIP_V;
-            break;
-        default:
-            dst.rot =  G2D_ROTATION_0;
-            break;
+    buffers.clear();
+    for (size_t i=0; i<commands.size(); i++) {
+        const Command& cmd = commands[i];
+        addCpuBuffer(buffers, cmd.srcMemory);
+        addCpuBuffer(buffers, cmd.bgMemory);
+        addCpuBuffer(buffers, cmd.dstMemory);
+    }
+    lockCpuBuffers(buffers);
+
+    // SoftEngine reads and writes through the mappings, commands on
+    // buffers not locked are left out.
+    for (size_t i=commands.size(); i>0; i--) {
+        const Command& cmd = commands[i-1];
+        bool locked = true;
+        if (cmd.type == CMD_FILL || cmd.type == CMD_BLIT ||
+            cmd.type == CMD_COMPOSITE) {
+            locked = hasCpuBuffer(buffers, cmd.dstMemory);
+        }
+        if (cmd.type == CMD_BLIT || cmd.type == CMD_COMPOSITE) {
+            locked = locked && hasCpuBuffer(buffers, cmd.srcMemory);
+        }
+        if (cmd.type == CMD_COMPOSITE) {
+            locked = locked && hasCpuBuffer(buffers, cmd.bgMemory);
+        }
+        if (!locked) {
+            ALOGW("%s drop command %d on unlocked buffer", __func__, cmd.type);
+            commands.removeAt(i-1);
+        }
     }
-
-    return 0;
 }
 
+void Composer::unlockCpuBuffers(Vector<Memory*>& buffers)
+{
+    MemoryManager* pManager = MemoryManager::getInstance();
+    for (size_t i=0; i<buffers.size(); i++) {
+        pManager->unlock(buffers[i]);
+    }
+}
 
-//    BLENDING_NONE     = 0x0100,
-int Composer::convertBlending(int blending, struct g2d_surface& src,
-                        struct g2d_surface& dst)
+void Composer::runCpuBlits(Vector<Command>& commands, Vector<CpuBlit>& cpuBlits)
 {
-    switch (blending) {
-        case BLENDING_PREMULT: //0x0105
-            src.blendfunc = G2D_ONE;
-            dst.blendfunc = G2D_ONE_MINUS_SRC_ALPHA;
-            break;
+    if (cpuBlits.isEmpty()) {
+        return;
+    }
 
-        case BLENDING_COVERAGE: //0x0405
-            src.blendfunc = G2D_SRC_ALPHA;
-            dst.blendfunc = G2D_ONE_MINUS_SRC_ALPHA;
-            break;
+    Vector<Memory*> buffers;
+    for (size_t i=0; i<cpuBlits.size(); i++) {
+        const Command& cmd = commands[cpuBlits[i].index];
+        addCpuBuffer(buffers, cmd.srcMemory);
+        addCpuBuffer(buffers, cmd.dstMemory);
+    }
+    lockCpuBuffers(buffers);
+
+    int64_t pixels = 0;
+    bool fallback = false;
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (size_t i=0; i<cpuBlits.size(); i++) {
+        const CpuBlit& blit = cpuBlits[i];
+        Command& cmd = commands.editItemAt(blit.index);
+        if (!isCpuLocked(buffers, cmd)) {
+            // finished right away, later CPU blits may overlap it.
+            Rect clip = blit.clip;
+            submitToEngine(cmd, blit.blend, blit.globalAlpha, clip);
+            finishEngine(mHandle);
+            fallback = true;
+            continue;
+        }
+        pixels += runCpuBlit(cmd, blit);
+    }
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    unlockCpuBuffers(buffers);
+
+    // pixels per us, smoothed over about eight frames.
+    if (elapsed > 0 && pixels > 0 && !fallback) {
+        int64_t rate = pixels * 1000 / elapsed;
+        mCpuRate = (mCpuRate * 7 + rate) / 8;
+        if (mCpuRate < 1) {
+            mCpuRate = 1;
+        }
+    }
+}
 
-        case BLENDING_DIM: //0x0805
-            src.blendfunc = G2D_ONE;
-            dst.blendfunc = G2D_ONE_MINUS_SRC_ALPHA;
-            break;
+int64_t Composer::runCpuBlit(const Command& cmd, const CpuBlit& blit)
+{
+    const struct g2d_surface& dst = cmd.dst.base;
+    int dbpp = (dst.format == G2D_RGB565) ? 2 : 4;
+    int dpitch = dst.stride * dbpp;
+    Rect drect = getSurfaceRect(dst);
+
+    if (cmd.type == CMD_FILL) {
+        // same pixel value the engine stores.
+        uint32_t c = g2d_pack_color(dst.clrcolor, (enum g2d_format)dst.format);
+        for (int y = drect.top; y < drect.bottom; y++) {
+            uint8_t* row = (uint8_t*)cmd.dstBase + y * dpitch + drect.left * dbpp;
+            if (dbpp == 4) {
+                fillRow32((uint32_t*)row, c, drect.width());
+            }
+            else {
+                fillRow16((uint16_t*)row, (uint16_t)c, drect.width());
+            }
+        }
+        return drect.width() * drect.height();
+    }
 
-        default:
-            src.blendfunc = G2D_ONE;
-            dst.blendfunc = G2D_ONE_MINUS_SRC_ALPHA;
-            break;
+    // same clip as the engine would apply.
+    Rect area = drect;
+    if (!blit.clip.isEmpty()) {
+        area.intersect(blit.clip, &area);
+        if (area.isEmpty()) {
+            return 0;
+        }
     }
 
-    return 0;
+    const struct g2d_surface& src = cmd.src.base;
+    bool hflip = (src.rot == G2D_FLIP_H || dst.rot == G2D_FLIP_H);
+    bool vflip = (src.rot == G2D_FLIP_V || dst.rot == G2D_FLIP_V);
+    int spitch = src.stride * dbpp;
+    int sx = src.left + (hflip ? drect.right - area.right :
+                                 area.left - drect.left);
+    bool premult = (src.blendfunc & 0xf) == G2D_ONE;
+    uint32_t alpha = blit.globalAlpha ? src.global_alpha : 0xff;
+    bool opaque = (src.format == G2D_RGBX8888 || src.format == G2D_BGRX8888);
+    for (int y = area.top; y < area.bottom; y++) {
+        int sy = src.top + (vflip ? drect.bottom - 1 - y : y - drect.top);
+        uint8_t* drow = (uint8_t*)cmd.dstBase + y * dpitch + area.left * dbpp;
+        const uint8_t* srow = (const uint8_t*)cmd.srcBase + sy * spitch +
+                              sx * dbpp;
+        if (dbpp == 2) {
+            copyRow16((uint16_t*)drow, (const uint16_t*)srow, area.width(),
+                      hflip);
+        }
+        else if (!blit.blend) {
+            copyRow32((uint32_t*)drow, (const uint32_t*)srow, area.width(),
+                      hflip);
+        }
+        else if (!hflip) {
+            blendRow32((uint32_t*)drow, (const uint32_t*)srow, area.width(),
+                       alpha, premult, opaque);
+        }
+        else {
+            // mirror the source row first.
+            int width = area.width();
+            if (mMirrorRow.size() < (size_t)width) {
+                mMirrorRow.resize(width);
+            }
+            uint32_t* mirror = mMirrorRow.editArray();
+            copyRow32(mirror, (const uint32_t*)srow, width, true);
+            blendRow32((uint32_t*)drow, mirror, width, alpha, premult, opaque);
+        }
+    }
+    return area.width() * area.height();
 }
 
-int Composer::getAlignedSize(Memory *handle, int *width, int *height)
+void Composer::splitRotatedBlits(Vector<Command>& commands,
+                                 Vector<bool>& dead, int targetPlane)
 {
-    if (mGetAlignedSize == NULL) {
-        return -EINVAL;
+    // stripes are rotated while the engine runs, it needs flush and wait.
+    if (mFlushEngine == NULL || mWaitEngine == NULL) {
+        return;
     }
 
-    return (*mGetAlignedSize)(handle, (void*)width, (void*)height);
+    int blend = mCapState[G2D_BLEND];
+    Rect clip(0, 0);
+    size_t count = commands.size();
+    for (size_t i=0; i<count; i++) {
+        Command& cmd = commands.editItemAt(i);
+        if (cmd.type == CMD_ENABLE && cmd.cap == G2D_BLEND) {
+            blend = cmd.enable ? 1 : 0;
+        }
+        if (isBlendClearingBlit(cmd)) {
+            blend = 0;
+        }
+        if (cmd.type == CMD_CLIP) {
+            clip = cmd.clip;
+        }
+        if (dead[i] || blend != 0 || !isSplitBlit(cmd, targetPlane) ||
+            isSourceWritten(commands, dead, i)) {
+            continue;
+        }
+
+        // nothing else in the frame may touch the rows CPU writes, find
+        // the rows free at the top and at the bottom of the blit.
+        Rect drect = getSurfaceRect(cmd.dst.base);
+        int topLimit = drect.bottom;
+        int bottomLimit = drect.top;
+        for (size_t j=0; j<count; j++) {
+            const Command& other = commands[j];
+            if (j == i || dead[j] || (other.type != CMD_FILL &&
+                other.type != CMD_BLIT && other.type != CMD_COMPOSITE)) {
+                continue;
+            }
+
+            for (int s = 0; s < 3; s++) {
+                const struct g2d_surface& surface = (s == 0) ? other.dst.base :
+                        ((s == 1) ? other.src.base : other.bg.base);
+                if ((s == 1 && other.type == CMD_FILL) ||
+                    (s == 2 && other.type != CMD_COMPOSITE) ||
+                    surface.planes[0] != targetPlane) {
+                    continue;
+                }
+                Rect area;
+                if (!getSurfaceRect(surface).intersect(drect, &area)) {
+                    continue;
+                }
+                topLimit = (area.top < topLimit) ? area.top : topLimit;
+                bottomLimit = (area.bottom > bottomLimit) ? area.bottom :
+                                                            bottomLimit;
+            }
+        }
+
+        // engine part keeps its position aligned to the rotation block.
+        int rows = drect.height() * mCpuShare / 1024;
+        int bottomCut = drect.bottom - rows;
+        bottomCut = ALIGN_PIXEL((bottomCut > bottomLimit) ? bottomCut :
+                                bottomLimit, ROT_BLOCK_SIZE);
+        int topCut = drect.top + rows;
+        topCut = ((topCut < topLimit) ? topCut : topLimit) &
+                 ~(ROT_BLOCK_SIZE - 1);
+
+        Rect stripe, rest;
+        if (drect.bottom - bottomCut >= topCut - drect.top) {
+            stripe = Rect(drect.left, bottomCut, drect.right, drect.bottom);
+            rest = Rect(drect.left, drect.top, drect.right, bottomCut);
+        }
+        else {
+            stripe = Rect(drect.left, drect.top, drect.right, topCut);
+            rest = Rect(drect.left, topCut, drect.right, drect.bottom);
+        }
+        if (stripe.height() < ROT_BLOCK_SIZE || rest.isEmpty()) {
+            continue;
+        }
+
+        Rect srect = getSurfaceRect(cmd.src.base);
+        int rot = cmd.dst.base.rot;
+        Rect area = stripe;
+        if (clip.isEmpty() || stripe.intersect(clip, &area)) {
+            Command part = cmd;
+            setSurfaceRect(part.src.base,
+                           mapClipToSource(srect, drect, area, rot));
+            setSurfaceRect(part.dst.base, area);
+            mStripes.add(part);
+        }
+        setSurfaceRect(cmd.src.base, mapClipToSource(srect, drect, rest, rot));
+        setSurfaceRect(cmd.dst.base, rest);
+    }
 }
 
-int Composer::getFlipOffset(Memory *handle, int *offset)
+bool Composer::isSourceWritten(const Vector<Command>& commands,
+                               const Vector<bool>& dead, size_t index)
 {
-    if (mGetFlipOffset == NULL) {
-        return -EINVAL;
+    // stripes run while the engine executes the whole frame, so a write
+    // to the source anywhere in the frame may race with the CPU read.
+    const struct g2d_surface& src = commands[index].src.base;
+    Rect srect = getSurfaceRect(src);
+    size_t count = commands.size();
+    for (size_t j=0; j<count; j++) {
+        const Command& other = commands[j];
+        if (j == index || dead[j] || (other.type != CMD_FILL &&
+            other.type != CMD_BLIT && other.type != CMD_COMPOSITE) ||
+            other.dst.base.planes[0] != src.planes[0]) {
+            continue;
+        }
+        Rect area;
+        if (getSurfaceRect(other.dst.base).intersect(srect, &area)) {
+            return true;
+        }
     }
 
-    return (*mGetFlipOffset)(handle, (void*)offset);
+    return false;
 }
 
-int Composer::getTiling(Memory *handle, enum g2d_tiling* tile)
+bool Composer::isSplitBlit(Command& cmd, int targetPlane)
 {
-    if (mGetTiling == NULL) {
-        return -EINVAL;
+    struct g2d_surface& src = cmd.src.base;
+    struct g2d_surface& dst = cmd.dst.base;
+    if (cmd.type != CMD_BLIT || cmd.srcBase == 0 || cmd.dstBase == 0 ||
+        dst.planes[0] != targetPlane || src.rot != G2D_ROTATION_0 ||
+        isFlipOnly(dst.rot) || !isSameSize(src, dst)) {
+        return false;
     }
 
-    return (*mGetTiling)(handle, (void*)tile);
+    Rect drect = getSurfaceRect(dst);
+    if (drect.width() * drect.height() < LOAD_SPLIT_MIN_PIXELS) {
+        return false;
+    }
+
+    // CPU copies alpha as is, a source without it needs a target without.
+    bool srcOpaque = (src.format == G2D_RGBX8888 || src.format == G2D_BGRX8888);
+    bool dstOpaque = (dst.format == G2D_RGBX8888 || dst.format == G2D_BGRX8888);
+    return getChannelOrder(src.format) != 0 &&
+           getChannelOrder(src.format) == getChannelOrder(dst.format) &&
+           (!srcOpaque || dstOpaque);
 }
 
-enum g2d_format Composer::alterFormat(Memory *handle, enum g2d_format format)
+nsecs_t Composer::runCpuStripes(Vector<Command>& unlocked)
 {
-    if (mAlterFormat == NULL) {
-        return format;
+    Vector<Memory*> buffers;
+    for (size_t i=0; i<mStripes.size(); i++) {
+        addCpuBuffer(buffers, mStripes[i].srcMemory);
+        addCpuBuffer(buffers, mStripes[i].dstMemory);
     }
 
-    return (enum g2d_format)(*mAlterFormat)(handle, (void*)format);
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    lockCpuBuffers(buffers);
+    unlocked.clear();
+    for (size_t i=0; i<mStripes.size(); i++) {
+        const Command& cmd = mStripes[i];
+        if (!isCpuLocked(buffers, cmd)) {
+            unlocked.add(cmd);
+            continue;
+        }
+        const struct g2d_surface& src = cmd.src.base;
+        const struct g2d_surface& dst = cmd.dst.base;
+        int rot = (dst.rot == G2D_ROTATION_90) ? 90 :
+                  ((dst.rot == G2D_ROTATION_180) ? 180 : 270);
+        uint32_t* out = (uint32_t*)cmd.dstBase + dst.top * dst.stride +
+                        dst.left;
+        const uint32_t* in = (const uint32_t*)cmd.srcBase +
+                             src.top * src.stride + src.left;
+        rotateRect32(out, dst.stride, in, src.stride, dst.right - dst.left,
+                     dst.bottom - dst.top, rot);
+    }
+    unlockCpuBuffers(buffers);
+
+    return systemTime(SYSTEM_TIME_MONOTONIC) - start;
 }
 
-int Composer::lockSurface(Memory *handle)
+void Composer::finishFrame()
 {
-    if (mLockSurface == NULL) {
-        return -EINVAL;
+    if (mStripes.isEmpty()) {
+        finishEngine(mHandle);
+        updateTaskCost();
+        return;
     }
 
-    return (*mLockSurface)(handle);
-}
+    // start the engine on its part and rotate the stripes meanwhile.
+    Vector<Command> unlocked;
+    bool flushed = (*mFlushEngine)(mHandle) == 0;
+    nsecs_t cpuTime = runCpuStripes(unlocked);
+    if (!flushed) {
+        finishEngine(mHandle);
+    }
+    else {
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+        (*mWaitEngine)(mHandle);
+        if (unlocked.isEmpty()) {
+            updateLoadShare(cpuTime,
+                            systemTime(SYSTEM_TIME_MONOTONIC) - start);
+        }
+    }
 
-int Composer::unlockSurface(Memory *handle)
-{
-    if (mUnlockSurface == NULL) {
-        return -EINVAL;
+    // stripes CPU could not reach are rotated by the engine after all.
+    if (!unlocked.isEmpty()) {
+        Rect clip(0, 0);
+        for (size_t i=0; i<unlocked.size(); i++) {
+            submitToEngine(unlocked.editItemAt(i), false, false, clip);
+        }
+        finishEngine(mHandle);
     }
+}
 
-    return (*mUnlockSurface)(handle);
+bool Composer::isCpuLocked(const Vector<Memory*>& buffers, const Command& cmd)
+{
+    return hasCpuBuffer(buffers, cmd.dstMemory) &&
+           (cmd.type != CMD_BLIT || hasCpuBuffer(buffers, cmd.srcMemory));
 }
 
-int Composer::setClipping(Rect& src, Rect& dst, Rect& clip, int rotation)
+void Composer::submitToEngine(Command& cmd, bool blend, bool globalAlpha,
+                              Rect& clip)
 {
-    if (mSetClipping == NULL) {
-        return -EINVAL;
+    int caps[CAP_STATE_SIZE];
+    for (int i = 0; i < CAP_STATE_SIZE; i++) {
+        caps[i] = -1;
     }
+    caps[G2D_BLEND] = blend ? 1 : 0;
+    caps[G2D_GLOBAL_ALPHA] = globalAlpha ? 1 : 0;
 
-    return (*mSetClipping)(mHandle, (void*)(intptr_t)clip.left,
-            (void*)(intptr_t)clip.top, (void*)(intptr_t)clip.right,
-            (void*)(intptr_t)clip.bottom);
+    if (cmd.type == CMD_FILL) {
+        (*mClearFunction)(mHandle, &cmd.dst.base);
+        return;
+    }
+    applyState(caps, clip, mSetClipping != NULL);
+    (*mBlitFunction)(mHandle, &cmd.src, &cmd.dst);
 }
 
-int Composer::blitSurface(struct g2d_surfaceEx *srcEx, struct g2d_surfaceEx *dstEx)
+void Composer::updateLoadShare(nsecs_t cpuTime, nsecs_t waitTime)
 {
-    if (mBlitFunction == NULL) {
-        return -EINVAL;
+    // engine still busy when CPU is done, move rows to CPU in proportion
+    // to the wait. Otherwise CPU finished last, give some back.
+    int64_t share = mCpuShare;
+    if (waitTime > LOAD_WAIT_SLACK) {
+        share += share * waitTime / (2 * (cpuTime + 1));
+    }
+    else {
+        share -= share / 8;
     }
 
-    return (*mBlitFunction)(mHandle, srcEx, dstEx);
+    if (share < LOAD_SHARE_MIN) {
+        share = LOAD_SHARE_MIN;
+    }
+    if (share > LOAD_SHARE_MAX) {
+        share = LOAD_SHARE_MAX;
+    }
+    mCpuShare = (int)share;
 }
 
 int Composer::openEngine(void** handle)
@@ -736,7 +3308,16 @@ int Composer::clearFunction(void* handle, struct g2d_surface* area)
         return -EINVAL;
     }
 
-    return (*mClearFunction)(handle, area);
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = CMD_FILL;
+    cmd.dst.base = *area;
+    Rect rect = getSurfaceRect(*area);
+    if (mSoftware || rect.width() * rect.height() <= CPU_BLIT_MAX_PIXELS) {
+        cmd.dstBase = getSurfaceBase(area->planes[0], &cmd.dstMemory);
+    }
+    mCommands.add(cmd);
+    return 0;
 }
 
 int Composer::enableFunction(void* handle, enum g2d_cap_mode cap, bool enable)
@@ -745,15 +3326,18 @@ int Composer::enableFunction(void* handle, enum g2d_cap_mode cap, bool enable)
         return -EINVAL;
     }
 
-    int ret = 0;
-    if (enable) {
-        ret = (*mEnableFunction)(handle, (void*)cap);
-    }
-    else {
-        ret = (*mDisableFunction)(handle, (void*)cap);
+    if ((int)cap < 0 || (int)cap >= CAP_STATE_SIZE) {
+        ALOGE("enableFunction: unsupported cap:%d", cap);
+        return -EINVAL;
     }
 
-    return ret;
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = CMD_ENABLE;
+    cmd.cap = cap;
+    cmd.enable = enable;
+    mCommands.add(cmd);
+    return 0;
 }
 
 int Composer::finishEngine(void* handle)
@@ -776,6 +3360,40 @@ bool Composer::isFeatureSupported(g2d_feature feature)
     return (enable != 0);
 }
 
+//----------------------------------------------------------
+Composer::ComposeThread::ComposeThread(Composer *ctx)
+    : Thread(false), mCtx(ctx)
+{
+}
+
+void Composer::ComposeThread::onFirstRef()
+{
+    run("HWC-Compose-Thread", android::PRIORITY_URGENT_DISPLAY);
+}
+
+void Composer::ComposeThread::signal()
+{
+    Mutex::Autolock _l(mLock);
+    mCondition.signal();
+}
+
+bool Composer::ComposeThread::threadLoop()
+{
+    { // scope for lock
+        Mutex::Autolock _l(mLock);
+        while (!mCtx->hasQueuedFrame() && !exitPending()) {
+            mCondition.wait(mLock);
+        }
+    }
+
+    if (!mCtx->hasQueuedFrame()) {
+        return false;
+    }
+
+    mCtx->runQueuedFrame();
+    return true;
+}
+
 }
 
 
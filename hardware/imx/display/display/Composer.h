@@ -18,12 +18,32 @@
 #ifndef _FSL_COMPOSER_H_
 #define _FSL_COMPOSER_H_
 
+#include <atomic>
 #include <g2dExt.h>
+#include <utils/Condition.h>
+#include <utils/Mutex.h>
+#include <utils/Thread.h>
+#include <utils/Timers.h>
 #include "Memory.h"
 #include "Layer.h"
 
 namespace fsl {
 
+// max number of rotation scratch buffers kept across frames.
+#define ROT_POOL_SIZE 16
+// max number of source buffers tracked by the rotated content cache.
+#define ROT_CACHE_SIZE 8
+// frames of damage kept to repair targets by their buffer age.
+#define DAMAGE_HISTORY 4
+// max number of render targets tracked for buffer age.
+#define TARGET_AGE_SIZE 4
+// max number of buffers with cached g2d surface description.
+#define SURFACE_CACHE_SIZE 32
+// number of g2d capabilities tracked by the command list.
+#define CAP_STATE_SIZE 16
+// max number of recorded frames waiting for the composition worker.
+#define FRAME_QUEUE_SIZE 4
+
 typedef int (*hwc_func1)(void* handle);
 typedef int (*hwc_func2)(void* handle, void* arg1);
 typedef int (*hwc_func3)(void* handle, void* arg1, void* arg2);
@@ -43,32 +63,153 @@ public:
     int clearWormHole(LayerVector& layers);
     // compose display layer.
     int composeLayer(Layer* layer, bool bypass);
-    // sync 2D blit engine.
+    // commit composition to 2D blit engine.
     int finishComposite();
+    // wait for all committed frames to be composed.
+    int waitComposite();
     // lock surface to get GPU specific resource.
     int lockSurface(Memory *handle);
     // unlock surface to release resource.
     int unlockSurface(Memory *handle);
     bool isFeatureSupported(g2d_feature feature);
+    // forget damage history and cached rotations, targets are fully
+    // recomposed next frame.
+    void invalidateDamage();
+    // check whether layers are the same as last composed into target.
+    bool isLayerStackUnchanged(LayerVector& layers, Memory* target);
+    // check whether a layer the engine can't read was left out of the
+    // frame composed into the current target.
+    bool hasSkippedLayers();
 
 private:
+    // submits recorded frames to the blit engine off the HWC thread.
+    class ComposeThread : public Thread {
+    public:
+        explicit ComposeThread(Composer *ctx);
+        void signal();
+
+    private:
+        virtual void onFirstRef();
+        virtual bool threadLoop();
+
+        Composer *mCtx;
+        mutable Mutex mLock;
+        Condition mCondition;
+    };
+
+    bool hasQueuedFrame();
+    void runQueuedFrame();
+    void waitFrames(uint32_t seq);
+    void waitFrameDone(uint32_t frame);
     int setG2dSurface(struct g2d_surfaceEx& surfaceX, Memory *handle, Rect& rect);
+    int buildG2dSurface(struct g2d_surfaceEx& surfaceX, Memory *handle);
     enum g2d_format convertFormat(int format, Memory *handle);
     int convertRotation(int transform, struct g2d_surface& src,
                         struct g2d_surface& dst);
     int convertBlending(int blending, struct g2d_surface& src,
                         struct g2d_surface& dst);
     int checkDimBuffer();
+    void setDimColor(uint32_t color);
     int allocRotBuffer(int width, int height, int transform);
+    int acquireRotBuffer(int width, int height, bool pinned);
+    int reserveArena();
+    int getArenaRows(int width);
+    void evictRotBuffers(uint32_t idleFrames, int bytes);
+    bool isRotationSafe(Layer* layer, struct g2d_surface& src,
+                        struct g2d_surface& dst, const Rect& clip,
+                        bool bypass);
+    int checkRotCache(Layer* layer, int transform, bool* hit);
+    void touchRotCache(Layer* layer);
+    void releaseRotCache(int index);
+    int allocAtlasRect(int width, int height, Rect* rect);
+    void releaseAtlasRect();
+    void calcDamage(LayerVector& layers);
+    struct LayerState;
+    bool isSameLayerState(const LayerState& state, Layer* layer);
+    Region getRepair(Memory* target, const Rect& screen);
+    Region widenRepair(LayerVector& layers, const Region& repair);
+    bool isScaledLayer(Layer* layer);
+    struct HoleState;
+    HoleState& getHoleState(Memory* target);
+    void resetHoleState(Memory* target);
+    void recordTargetAge(Memory* target);
+    int getFrameTransform(LayerVector& layers);
+    Rect mapToNative(const Rect& rect);
+    Region mapToNative(const Region& region);
+    Rect mapFromNative(const Rect& rect);
+    void beginFrameRotation(LayerVector& layers);
+    void endFrameRotation();
+    int rotateFrameEdge(Memory* native, const Rect& rect);
+    Layer* getFrameLayer(Layer* layer);
     int clearRect(Memory* target, Rect& rect);
+    int fillRect(Memory* target, Rect& rect, uint32_t color);
+    int fillSolidLayer(Layer* layer, Region& region);
+    bool isSameSize(struct g2d_surface& src, struct g2d_surface& dst);
+    Rect mapClipToSource(const Rect& srect, const Rect& drect,
+                         const Rect& clip, int rot);
+    int rotateClip(Layer* layer, struct g2d_surfaceEx& sSurfaceX,
+                   struct g2d_surfaceEx& dSurfaceX, Rect& clip, bool bypass);
+    int rotateStripe(Layer* layer, struct g2d_surfaceEx& sSurfaceX,
+                     struct g2d_surfaceEx& dSurfaceX, Rect& clip, bool bypass);
+    bool isScaleFirst(struct g2d_surface& src, struct g2d_surface& dst);
+    int scaleRotateClip(Layer* layer, struct g2d_surfaceEx& sSurfaceX,
+                        struct g2d_surfaceEx& dSurfaceX, Rect& clip,
+                        bool bypass, bool* rotated);
+    int rotateInto(Layer* layer, struct g2d_surfaceEx& sSurfaceX,
+                   struct g2d_surfaceEx& rSurfaceX);
+    int blendRotated(Layer* layer, struct g2d_surfaceEx& rSurfaceX,
+                     struct g2d_surfaceEx& dSurfaceX, bool bypass);
+    int composeRegion(Layer* layer, Region& region, bool bypass);
+    bool isFusableBottom(Layer* layer);
+    bool isFusableTop(Layer* bottom, Layer* layer);
+    int composeFused(Layer* bottom, Layer* layer, Region& region);
+    void flushFusedBottom();
 
     int getAlignedSize(Memory *handle, int *width, int *height);
     int getFlipOffset(Memory *handle, int *offset);
     int getTiling(Memory *handle, enum g2d_tiling* tile);
+    bool isCpuMapped(Memory* handle);
+    void mapCpuBuffer(Memory* handle);
+    bool isLayerReadable(Layer* layer);
+    int getPlaneAddress(Memory* handle);
     enum g2d_format alterFormat(Memory *handle, enum g2d_format format);
 
     int setClipping(Rect& src, Rect& dst, Rect& clip, int rotation);
+    int clearClipping();
     int blitSurface(struct g2d_surfaceEx *srcEx, struct g2d_surfaceEx *dstEx);
+    int compositeSurface(struct g2d_surfaceEx *srcEx,
+                struct g2d_surfaceEx *bgEx, struct g2d_surfaceEx *dstEx);
+    struct Command;
+    struct CpuBlit;
+    int submitCommands(Vector<Command>& commands, int targetPlane,
+                       Vector<CpuBlit>& cpuBlits);
+    static bool isBlendClearingBlit(const Command& cmd);
+    void cullCommands(Vector<Command>& commands, Vector<bool>& dead);
+    void pickCpuBlits(Vector<Command>& commands, Vector<bool>& dead,
+                      int targetPlane, Vector<bool>& cpu);
+    bool isCpuBlit(const Command& cmd, int targetPlane, bool blend);
+    int getCpuThreshold();
+    uintptr_t getSurfaceBase(int plane, Memory** memory);
+    void addCpuBuffer(Vector<Memory*>& buffers, Memory* memory);
+    void lockCpuBuffers(Vector<Memory*>& buffers);
+    bool hasCpuBuffer(const Vector<Memory*>& buffers, Memory* memory);
+    bool isCpuLocked(const Vector<Memory*>& buffers, const Command& cmd);
+    void submitToEngine(Command& cmd, bool blend, bool globalAlpha,
+                        Rect& clip);
+    void lockFrameBuffers(Vector<Command>& commands, Vector<Memory*>& buffers);
+    void unlockCpuBuffers(Vector<Memory*>& buffers);
+    void runCpuBlits(Vector<Command>& commands, Vector<CpuBlit>& cpuBlits);
+    int64_t runCpuBlit(const Command& cmd, const CpuBlit& blit);
+    void splitRotatedBlits(Vector<Command>& commands, Vector<bool>& dead,
+                           int targetPlane);
+    bool isSplitBlit(Command& cmd, int targetPlane);
+    bool isSourceWritten(const Vector<Command>& commands,
+                         const Vector<bool>& dead, size_t index);
+    nsecs_t runCpuStripes(Vector<Command>& unlocked);
+    void finishFrame();
+    void updateTaskCost();
+    void updateLoadShare(nsecs_t cpuTime, nsecs_t waitTime);
+    void applyState(int* caps, Rect& clip, bool withClip);
     int openEngine(void** handle);
     int closeEngine(void* handle);
     int clearFunction(void* handle, struct g2d_surface* area);
@@ -77,11 +218,198 @@ private:
 
 private:
     void* mHandle;
+    // libg2d is missing and SoftEngine composes on the CPU.
+    bool mSoftware;
     Memory* mTarget;
     Memory* mDimBuffer;
+    // color the dim buffer is filled with, RGBA8888.
+    uint32_t mDimColor;
     Memory* mRotBuffer;
-    Memory* mRotBuffers[64];
-    int N;
+    // opaque bottom layer waiting to be blended with the next layer.
+    Layer* mFuseBottom;
+    // a layer was left out of the frame since it can't be read.
+    bool mLayerSkipped;
+
+    // rotation scratch pool, kept across frames and evicted when idle.
+    struct RotEntry {
+        Memory* memory;
+        int width;
+        int height;
+        int format;
+        int bytes;
+        uint32_t lastUsed;
+        bool pinned;
+    };
+    RotEntry mRotPool[ROT_POOL_SIZE];
+
+    // rotated content of static layers, valid as long as the source
+    // buffer stays on screen in consecutive frames.
+    struct RotCacheEntry {
+        Memory* source;
+        uint64_t phys;
+        int transform;
+        int alpha;
+        Rect crop;
+        int pool;
+        bool atlas;
+        // rotated content in the pool buffer or in the atlas.
+        Rect rect;
+        bool filled;
+        uint32_t lastFrame;
+    };
+    RotCacheEntry mRotCache[ROT_CACHE_SIZE];
+    // origin of rotated content in mRotBuffer.
+    int mRotLeft;
+    int mRotTop;
+
+    // cached rotated content packed in one pool buffer by shelves.
+    struct RotShelf {
+        int top;
+        int height;
+        int used;
+    };
+    Vector<RotShelf> mAtlasShelves;
+    int mAtlasPool;
+    int mAtlasBottom;
+    int mAtlasUsers;
+
+    // layer stack of last frame, used to calculate frame damage.
+    struct LayerState {
+        Memory* handle;
+        int transform;
+        int blendMode;
+        int planeAlpha;
+        uint32_t color;
+        Rect sourceCrop;
+        Rect displayFrame;
+        Region visibleRegion;
+    };
+    Vector<LayerState> mLayerStates;
+    bool mDamageValid;
+    Region mDamage[DAMAGE_HISTORY];
+
+    struct TargetAge {
+        Memory* target;
+        uint32_t frame;
+    };
+    TargetAge mTargetAges[TARGET_AGE_SIZE];
+    // g2d description of recently used buffers, only rect changes per blit.
+    struct SurfaceEntry {
+        Memory* memory;
+        uint64_t phys;
+        int width;
+        int height;
+        int stride;
+        int fslFormat;
+        struct g2d_surfaceEx surfaceX;
+        uint32_t lastUsed;
+    };
+    SurfaceEntry mSurfaceCache[SURFACE_CACHE_SIZE];
+
+    // g2d operations of current frame, submitted in finishComposite.
+    enum {
+        CMD_FILL,
+        CMD_BLIT,
+        CMD_COMPOSITE,
+        CMD_ENABLE,
+        CMD_CLIP,
+    };
+    struct Command {
+        int type;
+        int cap;
+        bool enable;
+        Rect clip;
+        struct g2d_surfaceEx src;
+        struct g2d_surfaceEx bg;
+        struct g2d_surfaceEx dst;
+        // CPU mappings of src and dst planes, 0 if not known, and the
+        // buffers they belong to. bgMemory is only known in CPU composite.
+        uintptr_t srcBase;
+        uintptr_t dstBase;
+        Memory* srcMemory;
+        Memory* dstMemory;
+        Memory* bgMemory;
+    };
+    Vector<Command> mCommands;
+    // blit below the PXP task cost done by CPU after the engine finished.
+    struct CpuBlit {
+        size_t index;
+        bool blend;
+        bool globalAlpha;
+        Rect clip;
+    };
+    // measured PXP task cost in ns and CPU blit rate in pixels per us,
+    // owned by worker.
+    int64_t mTaskCost;
+    int64_t mCpuRate;
+    // engine tasks of the frame being submitted, their pixels and the
+    // submit start, owned by worker.
+    int mFrameTasks;
+    int64_t mFramePixels;
+    nsecs_t mSubmitStart;
+    // source row mirrored for flipped CPU blends, owned by worker.
+    Vector<uint32_t> mMirrorRow;
+    // rows of large rotated blits the CPU rotates while the engine does
+    // the rest, and the CPU share of such blits in 1/1024, owned by worker.
+    Vector<Command> mStripes;
+    int mCpuShare;
+
+    // single producer single consumer ring of recorded frames, the HWC
+    // thread advances mQueueHead and the worker advances mQueueTail once
+    // a frame completed.
+    struct Frame {
+        Vector<Command> commands;
+        int targetPlane;
+    };
+    Frame mFrames[FRAME_QUEUE_SIZE];
+    std::atomic<uint32_t> mQueueHead;
+    std::atomic<uint32_t> mQueueTail;
+    sp<ComposeThread> mWorker;
+    // only used to sleep while waiting for the worker.
+    Mutex mDoneLock;
+    Condition mDoneCond;
+
+    // engine state as last submitted, -1 if unknown, owned by worker.
+    int mCapState[CAP_STATE_SIZE];
+    Rect mClipState;
+    bool mClipValid;
+
+    // whole frame rotation, layers sharing one rotation are composed
+    // unrotated into a native buffer which is rotated once to mFrameTarget.
+    struct FrameLayer {
+        Layer* layer;
+        // copy of layer in native buffer coordinates.
+        Layer native;
+    };
+    Vector<FrameLayer> mFrameLayers;
+    Memory* mFrameTarget;
+    int mFrameTransform;
+    int mFramePool;
+    Rect mFrameScreen;
+    Region mFrameRepair;
+
+    // worm hole of last layer geometry and the part of it no layer covers.
+    bool mGeometryChanged;
+    bool mHoleValid;
+    int mHoleMode;
+    Rect mHoleBounds;
+    Region mHoles;
+    Region mBareHoles;
+    // part of holes known to be black in each target.
+    struct HoleState {
+        Memory* target;
+        Region black;
+        uint32_t frame;
+    };
+    HoleState mHoleStates[TARGET_AGE_SIZE];
+
+    // region of current target which needs to be recomposed.
+    Region mRepair;
+    int mRotPoolBytes;
+    int mRotPoolBudget;
+    // pinned pool buffer all unpinned rotation scratch is carved from.
+    int mArenaPool;
+    uint32_t mFrameCount;
 
     hwc_func3 mGetAlignedSize;
     hwc_func2 mGetFlipOffset;
@@ -92,12 +420,15 @@ private:
 
     hwc_func5 mSetClipping;
     hwc_func3 mBlitFunction;
+    hwc_func4 mCompositeFunction;
     hwc_func1 mOpenEngine;
     hwc_func1 mCloseEngine;
     hwc_func2 mClearFunction;
     hwc_func2 mEnableFunction;
     hwc_func2 mDisableFunction;
     hwc_func1 mFinishEngine;
+    hwc_func1 mFlushEngine;
+    hwc_func1 mWaitEngine;
     hwc_func3 mQueryFeature;
 };
 
@@ -60,6 +60,10 @@ int FbDisplay::setPowerMode(int mode)
 {
     Mutex::Autolock _l(mLock);
 
+    // content composed before a blank is not known to survive it.
+    if (mode != mPowerMode) {
+        mComposer.invalidateDamage();
+    }
     mPowerMode = mode;
     //HDMI need to keep unblank since audio need to be able to output
     //through HDMI cable. Blank the HDMI will lost the HDMI clock
@@ -148,6 +152,10 @@ int FbDisplay::updateScreen()
               config.mXres, config.mYres, config.mFormat);
     }
 
+    // layer buffers are returned without release fences once present
+    // returns, composition reading them must be done by then.
+    mComposer.waitComposite();
+
     struct mxcfb_buffer mxcbuf;
     mxcbuf.xoffset = mxcbuf.yoffset = 0;
     mxcbuf.stride = config.mStride;
@@ -330,10 +338,13 @@ void FbDisplay::prepareTargetsLocked()
         }
     }
     mTargetIndex = 0;
+    // new targets have no valid content to be repaired.
+    mComposer.invalidateDamage();
 }
 
 void FbDisplay::releaseTargetsLocked()
 {
+    mComposer.waitComposite();
     MemoryManager* pManager = MemoryManager::getInstance();
     for (int i=0; i<MAX_FRAMEBUFFERS; i++) {
         if (mTargets[i] == NULL) {
@@ -446,12 +457,38 @@ int FbDisplay::composeLayers()
     // mLayerVector's size > 0 means 2D composite.
     // only this case needs override mRenderTarget.
     if (mLayerVector.size() > 0) {
+        // nothing changed since last frame, present the same target again.
+        if (mComposer.isLayerStackUnchanged(mLayerVector, mRenderTarget)) {
+            ALOGV("%s layers unchanged, skip composition", __func__);
+            for (size_t i=0; i<mLayerVector.size(); i++) {
+                Layer* layer = mLayerVector[i];
+                if (layer->acquireFence != -1) {
+                    close(layer->acquireFence);
+                    layer->acquireFence = -1;
+                }
+            }
+            return 0;
+        }
+
         mTargetIndex = mTargetIndex % MAX_FRAMEBUFFERS;
         mRenderTarget = mTargets[mTargetIndex];
         mTargetIndex++;
     }
+    else {
+        // client composition, layer changes are not seen by 2D composer.
+        mComposer.invalidateDamage();
+    }
+
+    int ret = composeLayersLocked();
+    if (mLayerVector.size() > 0 && mComposer.hasSkippedLayers()) {
+        // composition types are chosen outside this display, so a layer
+        // the engine can't read is missing from the frame. The frame must
+        // not be repaired later or presented again as unchanged.
+        ALOGW("%s layers left out of 2D composition", __func__);
+        mComposer.invalidateDamage();
+    }
 
-    return composeLayersLocked();
+    return ret;
 }
 
 void FbDisplay::handleVsyncEvent(nsecs_t timestamp)
@@ -0,0 +1,599 @@
+/*
+ * Copyright 2017 NXP.
+ * 2018 zaferkaya1960@hotmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FSL_SOFT_ENGINE_H_
+#define _FSL_SOFT_ENGINE_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <unistd.h>
+#include <cutils/log.h>
+#include <g2dExt.h>
+#include <g2d_color.h>
+#include <utils/Condition.h>
+#include <utils/Mutex.h>
+#include <utils/Thread.h>
+#include <utils/Vector.h>
+#include "BlitKernels.h"
+
+namespace fsl {
+
+// rows handed out to a thread at a time.
+#define SOFT_BAND_ROWS 32
+// columns of a tile, rotated sources are read a tile at a time so the
+// rows touched stay in cache.
+#define SOFT_TILE_SIZE 32
+#define SOFT_MAX_THREADS 4
+// blits smaller than this are not worth waking up other threads.
+#define SOFT_PARALLEL_PIXELS (64 * 1024)
+
+/*
+ * Runs the bands of a job on all cores. Each thread owns a range of bands,
+ * takes bands from its front and steals from the back of other ranges
+ * once its own range is empty.
+ */
+class SoftPool
+{
+public:
+    typedef void (*BandFunc)(void* ctx, int band);
+
+    SoftPool()
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        mThreads = (cores < 1) ? 1 :
+                   ((cores > SOFT_MAX_THREADS) ? SOFT_MAX_THREADS : cores);
+        mFunc = NULL;
+        mCtx = NULL;
+        mGeneration = 0;
+        mActive = 0;
+        mPending = 0;
+        for (int i = 0; i < SOFT_MAX_THREADS; i++) {
+            mRanges[i] = 0;
+        }
+        for (int i = 1; i < mThreads; i++) {
+            mHelpers[i] = new Helper(this, i);
+        }
+    }
+
+    ~SoftPool()
+    {
+        for (int i = 1; i < mThreads; i++) {
+            mHelpers[i]->requestExit();
+        }
+        {
+            android::Mutex::Autolock _l(mLock);
+            mStart.broadcast();
+        }
+        for (int i = 1; i < mThreads; i++) {
+            mHelpers[i]->join();
+            mHelpers[i] = NULL;
+        }
+    }
+
+    void run(BandFunc func, void* ctx, int bands, bool parallel)
+    {
+        if (!parallel || mThreads == 1 || bands < 2) {
+            for (int i = 0; i < bands; i++) {
+                (*func)(ctx, i);
+            }
+            return;
+        }
+
+        // contiguous ranges, so owners walk their rows in order.
+        for (int i = 0; i < mThreads; i++) {
+            uint32_t begin = bands * i / mThreads;
+            uint32_t end = bands * (i + 1) / mThreads;
+            mRanges[i] = ((uint64_t)end << 32) | begin;
+        }
+        mPending = bands;
+        {
+            android::Mutex::Autolock _l(mLock);
+            mFunc = func;
+            mCtx = ctx;
+            mActive = mThreads - 1;
+            mGeneration++;
+            mStart.broadcast();
+        }
+
+        work(0);
+
+        android::Mutex::Autolock _l(mLock);
+        while (mPending > 0 || mActive > 0) {
+            mDone.wait(mLock);
+        }
+    }
+
+private:
+    class Helper : public android::Thread {
+    public:
+        Helper(SoftPool* pool, int index)
+            : Thread(false), mPool(pool), mIndex(index), mSeen(0)
+        {
+        }
+
+    private:
+        virtual void onFirstRef()
+        {
+            run("HWC-Soft-Thread", android::PRIORITY_URGENT_DISPLAY);
+        }
+
+        virtual bool threadLoop()
+        {
+            {
+                android::Mutex::Autolock _l(mPool->mLock);
+                while (mSeen == mPool->mGeneration && !exitPending()) {
+                    mPool->mStart.wait(mPool->mLock);
+                }
+                if (exitPending()) {
+                    return false;
+                }
+                mSeen = mPool->mGeneration;
+            }
+
+            mPool->work(mIndex);
+
+            android::Mutex::Autolock _l(mPool->mLock);
+            mPool->mActive--;
+            mPool->mDone.signal();
+            return true;
+        }
+
+        SoftPool* mPool;
+        int mIndex;
+        uint32_t mSeen;
+    };
+
+    bool takeBand(int index, bool steal, int* band)
+    {
+        uint64_t range = mRanges[index].load();
+        uint32_t begin = (uint32_t)range;
+        uint32_t end = (uint32_t)(range >> 32);
+        while (begin < end) {
+            uint64_t next = steal ? (((uint64_t)(end - 1) << 32) | begin) :
+                                    (((uint64_t)end << 32) | (begin + 1));
+            if (mRanges[index].compare_exchange_weak(range, next)) {
+                *band = steal ? end - 1 : begin;
+                return true;
+            }
+            begin = (uint32_t)range;
+            end = (uint32_t)(range >> 32);
+        }
+        return false;
+    }
+
+    void work(int self)
+    {
+        int band;
+        for (;;) {
+            bool found = takeBand(self, false, &band);
+            for (int i = 1; !found && i < mThreads; i++) {
+                found = takeBand((self + i) % mThreads, true, &band);
+            }
+            if (!found) {
+                return;
+            }
+
+            (*mFunc)(mCtx, band);
+            if (--mPending == 0) {
+                android::Mutex::Autolock _l(mLock);
+                mDone.signal();
+            }
+        }
+    }
+
+    int mThreads;
+    BandFunc mFunc;
+    void* mCtx;
+    // begin in the low and end in the high half.
+    std::atomic<uint64_t> mRanges[SOFT_MAX_THREADS];
+    std::atomic<int> mPending;
+    android::Mutex mLock;
+    android::Condition mStart;
+    android::Condition mDone;
+    uint32_t mGeneration;
+    int mActive;
+    android::sp<Helper> mHelpers[SOFT_MAX_THREADS];
+};
+
+/*
+ * CPU implementation of the libg2d calls the composer uses, with the same
+ * signatures so it plugs into the same function pointers. The handle is
+ * the engine and surface planes hold CPU addresses instead of physical
+ * ones. 32 bit RGB and RGB565 surfaces are supported, scaling samples the
+ * nearest pixel. Work is synchronous, finish has nothing to wait for.
+ */
+class SoftEngine
+{
+public:
+    static int open(void* handle)
+    {
+        *(void**)handle = new SoftEngine();
+        return 0;
+    }
+
+    static int close(void* handle)
+    {
+        delete (SoftEngine*)handle;
+        return 0;
+    }
+
+    static int enable(void* handle, void* cap)
+    {
+        return ((SoftEngine*)handle)->setCap((intptr_t)cap, true);
+    }
+
+    static int disable(void* handle, void* cap)
+    {
+        return ((SoftEngine*)handle)->setCap((intptr_t)cap, false);
+    }
+
+    static int setClipping(void* handle, void* left, void* top, void* right,
+                           void* bottom)
+    {
+        SoftEngine* engine = (SoftEngine*)handle;
+        engine->mClipLeft = (intptr_t)left;
+        engine->mClipTop = (intptr_t)top;
+        engine->mClipRight = (intptr_t)right;
+        engine->mClipBottom = (intptr_t)bottom;
+        return 0;
+    }
+
+    static int finish(void* handle)
+    {
+        return 0;
+    }
+
+    static bool isSupported(int format)
+    {
+        return getLayout(format) >= 0;
+    }
+
+    static int clear(void* handle, void* area)
+    {
+        return ((SoftEngine*)handle)->fill(*(struct g2d_surface*)area);
+    }
+
+    static int blit(void* handle, void* src, void* dst)
+    {
+        struct g2d_surface* dSurface = &((struct g2d_surfaceEx*)dst)->base;
+        return ((SoftEngine*)handle)->compose(
+                ((struct g2d_surfaceEx*)src)->base, *dSurface, *dSurface);
+    }
+
+    static int composite(void* handle, void* src, void* bg, void* dst)
+    {
+        return ((SoftEngine*)handle)->compose(*(struct g2d_surface*)src,
+                *(struct g2d_surface*)bg, *(struct g2d_surface*)dst);
+    }
+
+private:
+    SoftEngine()
+    {
+        mBlend = false;
+        mGlobalAlpha = false;
+        mClipLeft = mClipTop = mClipRight = mClipBottom = 0;
+    }
+
+    int setCap(intptr_t cap, bool enable)
+    {
+        switch (cap) {
+            case G2D_BLEND:
+                mBlend = enable;
+                return 0;
+            case G2D_GLOBAL_ALPHA:
+                mGlobalAlpha = enable;
+                return 0;
+            default:
+                return -1;
+        }
+    }
+
+    // 0 for RGBA order, 1 for BGRA order, 2 for RGB565, -1 unsupported.
+    static int getLayout(int format)
+    {
+        switch (format) {
+            case G2D_RGBA8888:
+            case G2D_RGBX8888:
+                return 0;
+            case G2D_BGRA8888:
+            case G2D_BGRX8888:
+                return 1;
+            case G2D_RGB565:
+                return 2;
+            default:
+                return -1;
+        }
+    }
+
+    // pixel of a surface as 32 bit with alpha on top, in layout order.
+    static inline uint32_t loadPixel(const struct g2d_surface& s, int layout,
+                                     bool opaque, int x, int y)
+    {
+        if (layout == 2) {
+            uint32_t p = ((const uint16_t*)(intptr_t)s.planes[0])[y * s.stride + x];
+            uint32_t r = (p >> 11) << 3, g = ((p >> 5) & 0x3f) << 2;
+            uint32_t b = (p & 0x1f) << 3;
+            return 0xff000000 | (b << 16) | (g << 8) | r;
+        }
+
+        uint32_t p = ((const uint32_t*)(intptr_t)s.planes[0])[y * s.stride + x];
+        return opaque ? (p | 0xff000000) : p;
+    }
+
+    static inline uint32_t swapRB(uint32_t p)
+    {
+        return (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+    }
+
+    static inline uint16_t packPixel(uint32_t p)
+    {
+        return ((p & 0xf8) << 8) | ((p >> 5) & 0x7e0) | ((p >> 19) & 0x1f);
+    }
+
+    int fill(struct g2d_surface& area)
+    {
+        int layout = getLayout(area.format);
+        if (layout < 0 || area.planes[0] == 0 ||
+            area.right <= area.left || area.bottom <= area.top) {
+            ALOGV("%s unsupported area format:%d", __func__, area.format);
+            return -1;
+        }
+
+        uint32_t color = g2d_pack_color(area.clrcolor,
+                                        (enum g2d_format)area.format);
+        for (int y = area.top; y < area.bottom; y++) {
+            if (layout == 2) {
+                uint16_t* row = (uint16_t*)(intptr_t)area.planes[0] +
+                                y * area.stride + area.left;
+                fillRow16(row, (uint16_t)color, area.right - area.left);
+            }
+            else {
+                uint32_t* row = (uint32_t*)(intptr_t)area.planes[0] +
+                                y * area.stride + area.left;
+                fillRow32(row, color, area.right - area.left);
+            }
+        }
+        return 0;
+    }
+
+    struct Job {
+        const struct g2d_surface* src;
+        const struct g2d_surface* bg;
+        const struct g2d_surface* dst;
+        int srcLayout;
+        int dstLayout;
+        bool srcOpaque;
+        bool bgOpaque;
+        bool blend;
+        bool premult;
+        bool clearUnder;
+        uint32_t alpha;
+        int rot;
+        bool hflip;
+        bool vflip;
+        // same format, no rotation nor scaling: source rows are used as is.
+        bool direct;
+        // destination area and its offset into the bg rect.
+        int left, top, right, bottom;
+        int bgDx, bgDy;
+        // source column and row for each step along source axes.
+        android::Vector<int> cols;
+        android::Vector<int> rows;
+    };
+
+    int compose(const struct g2d_surface& src, const struct g2d_surface& bg,
+                const struct g2d_surface& dst)
+    {
+        Job job;
+        job.src = &src;
+        job.bg = &bg;
+        job.dst = &dst;
+        job.srcLayout = getLayout(src.format);
+        job.dstLayout = getLayout(dst.format);
+        if (job.srcLayout < 0 || job.dstLayout < 0 ||
+            getLayout(bg.format) != job.dstLayout ||
+            src.planes[0] == 0 || dst.planes[0] == 0 || bg.planes[0] == 0) {
+            ALOGV("%s unsupported format src:%d dst:%d", __func__,
+                  src.format, dst.format);
+            return -1;
+        }
+
+        int dw = dst.right - dst.left;
+        int dh = dst.bottom - dst.top;
+        int sw = src.right - src.left;
+        int sh = src.bottom - src.top;
+        if (dw <= 0 || dh <= 0 || sw <= 0 || sh <= 0) {
+            return -1;
+        }
+
+        job.left = dst.left;
+        job.top = dst.top;
+        job.right = dst.right;
+        job.bottom = dst.bottom;
+        if (mClipLeft < mClipRight && mClipTop < mClipBottom) {
+            job.left = (mClipLeft > job.left) ? mClipLeft : job.left;
+            job.top = (mClipTop > job.top) ? mClipTop : job.top;
+            job.right = (mClipRight < job.right) ? mClipRight : job.right;
+            job.bottom = (mClipBottom < job.bottom) ? mClipBottom : job.bottom;
+            if (job.left >= job.right || job.top >= job.bottom) {
+                return 0;
+            }
+        }
+        job.bgDx = bg.left - dst.left;
+        job.bgDy = bg.top - dst.top;
+
+        // Fs and Fd as the PXP implements them, for the pairs in use.
+        job.blend = mBlend;
+        job.premult = (src.blendfunc & 0xf) == G2D_ONE;
+        job.clearUnder = false;
+        if (mBlend) {
+            int fs = src.blendfunc & 0xf;
+            int fd = dst.blendfunc & 0xf;
+            if ((fs != G2D_ONE && fs != G2D_SRC_ALPHA) ||
+                (fd != G2D_ONE_MINUS_SRC_ALPHA && fd != G2D_ZERO)) {
+                ALOGV("%s unsupported blend src:%d dst:%d", __func__, fs, fd);
+                return -1;
+            }
+            job.clearUnder = (fd == G2D_ZERO);
+        }
+        job.alpha = mGlobalAlpha ? src.global_alpha : 0xff;
+        job.srcOpaque = (src.format == G2D_RGBX8888 ||
+                         src.format == G2D_BGRX8888);
+        job.bgOpaque = (bg.format == G2D_RGBX8888 ||
+                        bg.format == G2D_BGRX8888);
+
+        job.rot = dst.rot;
+        job.hflip = (src.rot == G2D_FLIP_H || dst.rot == G2D_FLIP_H);
+        job.vflip = (src.rot == G2D_FLIP_V || dst.rot == G2D_FLIP_V);
+        bool swap = (job.rot == G2D_ROTATION_90 || job.rot == G2D_ROTATION_270);
+        int du = swap ? dh : dw;
+        int dv = swap ? dw : dh;
+        for (int u = 0; u < du; u++) {
+            int step = job.hflip ? du - 1 - u : u;
+            job.cols.add(src.left + step * sw / du);
+        }
+        for (int v = 0; v < dv; v++) {
+            int step = job.vflip ? dv - 1 - v : v;
+            job.rows.add(src.top + step * sh / dv);
+        }
+
+        job.direct = src.format == dst.format && job.srcLayout != 2 &&
+                     job.rot == 0 && !job.hflip && !job.vflip &&
+                     sw == dw && sh == dh;
+
+        int rows = job.bottom - job.top;
+        int bands = (rows + SOFT_BAND_ROWS - 1) / SOFT_BAND_ROWS;
+        bool parallel = (job.right - job.left) * rows >= SOFT_PARALLEL_PIXELS;
+        mPool.run(composeBand, &job, bands, parallel);
+        return 0;
+    }
+
+    static void composeBand(void* ctx, int band)
+    {
+        const Job& job = *(const Job*)ctx;
+        const struct g2d_surface& src = *job.src;
+        const struct g2d_surface& dst = *job.dst;
+        int dw = dst.right - dst.left;
+        int dh = dst.bottom - dst.top;
+        int y0 = job.top + band * SOFT_BAND_ROWS;
+        int y1 = (y0 + SOFT_BAND_ROWS < job.bottom) ? y0 + SOFT_BAND_ROWS :
+                                                      job.bottom;
+        bool convert = (job.srcLayout != job.dstLayout);
+
+        uint32_t pixels[SOFT_TILE_SIZE];
+        uint32_t under[SOFT_TILE_SIZE];
+        // tile columns outside, so a rotated source is read block by block.
+        for (int x0 = job.left; x0 < job.right; x0 += SOFT_TILE_SIZE) {
+            int n = (job.right - x0 < SOFT_TILE_SIZE) ? job.right - x0 :
+                                                        SOFT_TILE_SIZE;
+            for (int y = y0; y < y1; y++) {
+                int ry = y - dst.top;
+                if (job.direct) {
+                    const uint32_t* row = (const uint32_t*)(intptr_t)src.planes[0] +
+                            job.rows[ry] * src.stride + job.cols[x0 - dst.left];
+                    storeRow(job, x0, y, n, row, under);
+                    continue;
+                }
+
+                for (int i = 0; i < n; i++) {
+                    int rx = x0 + i - dst.left;
+                    int u, v;
+                    switch (job.rot) {
+                        case G2D_ROTATION_90:
+                            u = ry; v = dw - 1 - rx;
+                            break;
+                        case G2D_ROTATION_270:
+                            u = dh - 1 - ry; v = rx;
+                            break;
+                        case G2D_ROTATION_180:
+                            u = dw - 1 - rx; v = dh - 1 - ry;
+                            break;
+                        default:
+                            u = rx; v = ry;
+                            break;
+                    }
+                    uint32_t p = loadPixel(src, job.srcLayout, job.srcOpaque,
+                                           job.cols[u], job.rows[v]);
+                    // 565 expands in RGBA order.
+                    if (convert && (job.srcLayout == 1 || job.dstLayout == 1)) {
+                        p = swapRB(p);
+                    }
+                    pixels[i] = p;
+                }
+                storeRow(job, x0, y, n, pixels, under);
+            }
+        }
+    }
+
+    static void storeRow(const Job& job, int x, int y, int n,
+                         const uint32_t* pixels, uint32_t* under)
+    {
+        const struct g2d_surface& dst = *job.dst;
+        const struct g2d_surface& bg = *job.bg;
+        bool inPlace = (&bg == &dst) && job.dstLayout != 2;
+        uint32_t* out = inPlace ?
+                (uint32_t*)(intptr_t)dst.planes[0] + y * dst.stride + x : under;
+
+        if (!job.blend) {
+            if (inPlace) {
+                copyRow32(out, pixels, n, false);
+                return;
+            }
+            copyRow32(under, pixels, n, false);
+        }
+        else {
+            if (job.clearUnder) {
+                fillRow32(under, 0, n);
+                out = under;
+            }
+            else if (!inPlace) {
+                for (int i = 0; i < n; i++) {
+                    under[i] = loadPixel(bg, job.dstLayout, job.bgOpaque,
+                                         x + job.bgDx + i, y + job.bgDy);
+                }
+            }
+            blendRow32(out, pixels, n, job.alpha, job.premult, job.srcOpaque);
+            if (out != under) {
+                return;
+            }
+        }
+
+        if (job.dstLayout == 2) {
+            uint16_t* row = (uint16_t*)(intptr_t)dst.planes[0] +
+                            y * dst.stride + x;
+            for (int i = 0; i < n; i++) {
+                row[i] = packPixel(under[i]);
+            }
+        }
+        else {
+            uint32_t* row = (uint32_t*)(intptr_t)dst.planes[0] +
+                            y * dst.stride + x;
+            copyRow32(row, under, n, false);
+        }
+    }
+
+    bool mBlend;
+    bool mGlobalAlpha;
+    int mClipLeft;
+    int mClipTop;
+    int mClipRight;
+    int mClipBottom;
+    SoftPool mPool;
+};
+
+}
+#endif